@@ -1,21 +1,73 @@
 #include "VirtualMachine.h"
 #include "Machine.h"
+#include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <queue>
+#include <set>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #define VM_FILE_SYSTEM_ATTR_LONG_NAME_MASK (VM_FILE_SYSTEM_ATTR_READ_ONLY | VM_FILE_SYSTEM_ATTR_HIDDEN | VM_FILE_SYSTEM_ATTR_SYSTEM | VM_FILE_SYSTEM_ATTR_VOLUME_ID | VM_FILE_SYSTEM_ATTR_DIRECTORY | VM_FILE_SYSTEM_ATTR_ARCHIVE)
 
 #define VM_FILE_SYSTEM_ATTR_LONG_NAME (VM_FILE_SYSTEM_ATTR_READ_ONLY | VM_FILE_SYSTEM_ATTR_HIDDEN | VM_FILE_SYSTEM_ATTR_SYSTEM | VM_FILE_SYSTEM_ATTR_VOLUME_ID)
 
+#define VM_THREAD_PRIORITY_IDLE ((TVMThreadPriority)0x00)
+
+#define VM_BATCH_OP_READ                        0
+#define VM_BATCH_OP_WRITE                       1
+#define VM_BATCH_OP_SEEK                        2
+#define VM_BATCH_OP_MUTEX_ACQUIRE               3
+#define VM_BATCH_OP_MUTEX_RELEASE               4
+
 extern "C" {
 
+	typedef struct {
+		TVMTick DTicksRunning;
+		TVMTick DTicksReady;
+		TVMTick DTicksWaiting;
+		TVMTick DTicksMutexWait;	// part of DTicksWaiting spent blocked in VMMutexAcquire
+		unsigned int DContextSwitches;	// times the thread was switched onto the CPU
+		unsigned int DPriorityBoosts;	// times a waiter raised its priority through a mutex it owns
+	} SVMThreadStats, *SVMThreadStatsRef;
+
+	typedef struct {
+		TVMMemorySize DTotalBytes;
+		TVMMemorySize DFreeBytes;
+		TVMMemorySize DPeakUsedBytes;
+		TVMMemorySize DLargestFreeBytes;	// biggest single buffer that can be handed out right now
+		unsigned int DFreeBlocks;
+		unsigned int DFragmentation;	// percent of free bytes that are not in the largest free block
+	} SVMSharedMemoryStats, *SVMSharedMemoryStatsRef;
+
+	typedef unsigned int TVMConditionID, *TVMConditionIDRef;
+	typedef unsigned int TVMSemaphoreID, *TVMSemaphoreIDRef;
+	typedef unsigned int TVMRWLockID, *TVMRWLockIDRef;
+	typedef unsigned int TVMIORequestID, *TVMIORequestIDRef;
+
+	typedef struct {
+		int DOperation;	// VM_BATCH_OP_*
+		int DDescriptor;	// file descriptor, or mutex ID for the mutex operations
+		void *DData;
+		int DLength;	// bytes for a read or write, offset for a seek
+		int DWhence;
+		TVMTick DTimeout;	// for a mutex acquire
+	} SVMBatchOp, *SVMBatchOpRef;
+
+	typedef struct {
+		TVMStatus DStatus;
+		int DResult;	// bytes read or written, or the new offset for a seek
+	} SVMBatchCompletion, *SVMBatchCompletionRef;
+
 	TVMMainEntry VMLoadModule(const char *module);
 	void VMUnloadModule(void);
 	TVMStatus VMFilePrint(int filedescriptor, const char *format, ...);
@@ -23,6 +75,43 @@ extern "C" {
 	void VMStringCopy(char *dest, const char *src);
 	void VMStringCopyN(char *dest, const char *src, int32_t n);
 	TVMStatus VMDateTime(SVMDateTimeRef curdatetime);
+	TVMStatus VMTicklessIdle(int enable);
+	TVMStatus VMThreadStats(TVMThreadID thread, SVMThreadStatsRef statsref);
+	TVMStatus VMThreadStatsDump(void);
+	TVMStatus VMTraceEnable(int enable);
+	TVMStatus VMTraceExport(const char *filename);
+	TVMStatus VMStackPoolQuery(unsigned int *hits, unsigned int *misses, TVMMemorySizeRef reserved);
+	TVMStatus VMStackPoolPrefault(int enable);
+	TVMStatus VMSharedMemoryQuery(SVMSharedMemoryStatsRef statsref);
+	TVMStatus VMBufferAcquire(TVMMemorySize size, void **bufferref);
+	TVMStatus VMBufferRelease(void *buffer);
+	TVMStatus VMConditionCreate(TVMConditionIDRef conditionref);
+	TVMStatus VMConditionDelete(TVMConditionID condition);
+	TVMStatus VMConditionWait(TVMConditionID condition, TVMMutexID mutex, TVMTick timeout);
+	TVMStatus VMConditionSignal(TVMConditionID condition);
+	TVMStatus VMConditionBroadcast(TVMConditionID condition);
+	TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count);
+	TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore);
+	TVMStatus VMSemaphoreAcquire(TVMSemaphoreID semaphore, TVMTick timeout);
+	TVMStatus VMSemaphoreRelease(TVMSemaphoreID semaphore);
+	TVMStatus VMRWLockCreate(TVMRWLockIDRef rwlockref);
+	TVMStatus VMRWLockDelete(TVMRWLockID rwlock);
+	TVMStatus VMRWLockAcquireRead(TVMRWLockID rwlock, TVMTick timeout);
+	TVMStatus VMRWLockAcquireWrite(TVMRWLockID rwlock, TVMTick timeout);
+	TVMStatus VMRWLockRelease(TVMRWLockID rwlock);
+	TVMStatus VMFileReadAsync(int filedescriptor, void *data, int length, TVMIORequestIDRef requestref);
+	TVMStatus VMFileWriteAsync(int filedescriptor, void *data, int length, TVMIORequestIDRef requestref);
+	TVMStatus VMFileSeekAsync(int filedescriptor, int offset, int whence, TVMIORequestIDRef requestref);
+	TVMStatus VMFileOpenAsync(const char *filename, int flags, int mode, TVMIORequestIDRef requestref);
+	TVMStatus VMIOWait(TVMIORequestID request, TVMTick timeout, int *resultref);
+	TVMStatus VMIOPoll(TVMIORequestID request, int *resultref);
+	TVMStatus VMBatchSubmit(SVMBatchOpRef ops, unsigned int count, SVMBatchCompletionRef completions);
+	TVMStatus VMSectorCacheQuery(unsigned int *hits, unsigned int *misses, unsigned int *evictions, unsigned int *writes);
+	TVMStatus VMSectorCacheWriteBack(int enable);
+	TVMStatus VMFileSync(int filedescriptor);
+	TVMStatus VMReadaheadQuery(unsigned int *issued, unsigned int *hits);
+	TVMStatus VMFileDelete(const char *filename);
+	TVMStatus VMFileBuffered(int filedescriptor, int enable);
 
 	void alarmCallback(void *calldata);
 	void fileOpenCallback(void *calldata, int result);
@@ -30,25 +119,71 @@ extern "C" {
 	void fileWriteCallback(void *calldata, int result);
 	void fileSeekCallback(void* calldata, int result);
 	void fileReadCallback(void* calldata, int result);
+	void ioRequestCallback(void *calldata, int result);
 
 	TVMStatus InternalFileOpen(const char *filename, int flags, int mode, int *filedescriptor);
 	TVMStatus InternalFileClose(int filedescriptor);      
 	TVMStatus InternalFileRead(int filedescriptor, void *data, int *length);
 	TVMStatus InternalFileWrite(int filedescriptor, void *data, int *length);
 	TVMStatus InternalFileSeek(int filedescriptor, int offset, int whence, int *newoffset);
+	struct IORequest *ioRequestAlloc(int type);
+	void ioRequestFree(struct IORequest *request);
+	TVMStatus ioSubmit(int type, int filedescriptor, void *data, int length, int whence, struct IORequest **requestref);
+	void ioRequestWait(struct IORequest *request);
+	void fileIOWorker(void *param);
+	void fileIOSubmit(struct IORequest *request);
 
 	void scheduler();
+	void ticklessEnter();
+	void ticklessExit(bool alarmFired);
+	void callbackWake(struct Thread *thread);
 
 	void skeleton(void *data);
 	void idle(void *param);
-	void snapshot();
 	void displayBPB(struct BPB* bpb);
 	void displayFatInfo(struct FatInfo* curInfo);
 
+	void sectorCacheInit();
+	void sectorCacheTouch(int slot);
+	void sectorCacheInsert(int secNum, void* data, bool write);
+	void sectorCacheFlush();
+	void imageTransfer(int secNum, void* data, int count, bool write);
+	void flusher(void *param);
+	void prefetcher(void *param);
+	void readaheadUpdate(struct FileEntry *file, int cluster, int count, bool cached);
+	void readaheadCancel(struct FileEntry *file);
+	bool clusterCached(int clusterNum);
 	TVMStatus ReadSector(int secNum, void* data);
 	TVMStatus WriteSector(int secNum, void* data);
+	TVMStatus ReadSectors(int secNum, void* data, int count);
+	TVMStatus WriteSectors(int secNum, void* data, int count);
 	TVMStatus ReadCluster(int clusterNum, void* data);
 	TVMStatus WriteCluster(int clusterNum, void* data);
+	TVMStatus ReadClusters(int clusterNum, void* data, int count);
+	TVMStatus WriteClusters(int clusterNum, void* data, int count);
+	int clusterRun(int clusterNum, int maxClusters);
+	void freeSpaceInit();
+	void freeExtentAdd(int first, int count);
+	void freeExtentRemove(std::map<int, int>::iterator extent);
+	int clusterAlloc(int goal, int wanted, int *allocated);
+	void clusterRelease(int first, int count);
+	void fatSet(int cluster, uint16_t value);
+	unsigned int directoryHash(const char *shortName);
+	void directoryIndexInit();
+	void directoryIndexInsert(struct DirectoryEntry *entry);
+	void directoryIndexRemove(struct DirectoryEntry *entry);
+	struct DirectoryEntry *directoryLookup(const char *shortName);
+	int directorySlotAlloc();
+	void rootEntryWrite(int entryNum);
+	void rootEntryWriteBytes(int entryNum, int first, int count);
+	bool shortFileName(const char *filename, char *userCopy);
+	void extentMapBuild(struct FileEntry *file);
+	void extentMapAppend(struct FileEntry *file, int cluster);
+	int extentMapLookup(struct FileEntry *file, unsigned int offset, int *clusterOffset);
+	int fileNextCluster(struct FileEntry *file, int cluster, int wanted);
+	void fileMetadataWrite(struct FileEntry *file);
+	int fileWrite(struct FileEntry *file, uint8_t *source, int length);
+	bool fileFlush(struct FileEntry *file);
 	int getImageLocation(int clusNum);
 	void createFile(struct FileEntry* newFile, char* name, char* entryName);
 
@@ -56,16 +191,71 @@ extern "C" {
 	void setDateAccess(SVMDateTimeRef dateStruct, uint16_t dateBytes);
 	void encodeDateStruct(SVMDateTimeRef dateStruct, uint16_t* dateBytes, uint16_t* timeBytes);
 
+	void setState(struct Thread *thread, TVMThreadState state);
+	static inline void traceRecord(uint8_t type, TVMThreadID thread, uint32_t arg);
 	void makeReady(struct Thread *thread);
 	void makeWaiting(struct Thread *thread);
+	struct Thread *popReady();
 	void removeFromReady(struct Thread * thread);
 	void removeFromWaiting(struct Thread * thread);
 	void removeFromOwned(struct Thread* thread, TVMMutexID mutex);
-	void removeFromWaitingOnMutex(struct Thread *thread);
+	void setPriority(struct Thread *thread, TVMThreadPriority priority);
+	void priorityBoost(struct Thread *owner, TVMThreadPriority priority);
+	void priorityRestore(struct Thread *thread);
+	struct Thread *mutexNextOwner(struct Mutex *mutex);
+	void mutexWaitCancel(struct Thread *thread);
+	void mutexRelease(struct Mutex *mutex, struct Thread *oldOwner);
+	void waitBlock(struct ThreadQueue *queue, TVMTick timeout);
+	void waitWake(struct Thread *thread);
+	void rwlockWakeReaders(struct RWLock *rwlock);
+
+	void timerAdd(struct Thread *thread, TVMTick ticks);
+	void timerCancel(struct Thread *thread);
+	void timerExpire();
+	void timerSwap(unsigned int first, unsigned int second);
+	void timerSiftUp(unsigned int index);
+	void timerSiftDown(unsigned int index);
+
+	void handleTableInit(struct HandleTable *table);
+	unsigned int handleAlloc(struct HandleTable *table, void *object);
+	void *handleLookup(struct HandleTable *table, unsigned int handle);
+	void handleFree(struct HandleTable *table, unsigned int handle);
+
+	int stackSizeClass(TVMMemorySize memsize);
+	void *stackAlloc(TVMMemorySize memsize);
+	void stackFree(void *stack, TVMMemorySize memsize);
+
+	void buddyInit(TVMMemorySize size);
+	void buddyPush(int unit, int order);
+	void buddyRemove(int unit, int order);
+	void *sharedAlloc(TVMMemorySize size, TVMMemorySizeRef allocated);
+	void sharedFree(void *block);
+	TVMMemorySize sharedLargestFree();
+	struct Thread *memoryWaiterFit();
+	bool sharedLeased(void *data, int length);
+
+	void queueLinkInit(struct QueueLink *link, struct Thread *thread);
+	void queueInit(struct ThreadQueue *queue);
+	void queuePush(struct ThreadQueue *queue, struct QueueLink *link);
+	void queueRemove(struct QueueLink *link);
+	struct Thread *queuePop(struct ThreadQueue *queue);
+	struct Thread *queuePopHighest(struct ThreadQueue *queue);
 
 	static const int NOT_SET = 0;	// constant for if file descriptor has not been set, might be problematic
-	static const TVMMemorySize memSectionSize = 512;
+	static const TVMMemorySize memSectionSize = 512;	// smallest shared memory block, blocks are memSectionSize << order
+	static const int maxBuddyOrders = 24;
+	static const int maxIOInFlight = 16;	// most shared memory blocks one file read or write has out at a time
+	static const int maxIORequests = 64;	// async requests that can be outstanding at once
+	static const int sectorCacheSize = 256;	// image sectors kept in memory, 128 KiB
+	static const int maxCachedRun = sectorCacheSize / 8;	// longer sector runs are written around the cache
+	static const TVMTick flushIntervalTicks = 100;	// how often the flusher thread writes dirty sectors back
+	static const int maxReadaheadClusters = 8;	// largest readahead window, also capped to maxCachedRun sectors
 	static const TVMMemorySize pageSize = 4096;
+	static const TVMTick maxTicklessTicks = 1000;	// longest the alarm is pushed out when nothing is due
+	static const unsigned int traceBufferSize = 4096;	// power of two so the ring index wraps with a mask
+	static const int numStackClasses = 20;	// stack sizes are pageSize << class, up to 2 GiB
+	static const unsigned int handleIndexBits = 16;	// thread and mutex IDs are generation << 16 | slot index
+	static const unsigned int handleIndexMask = (1u << handleIndexBits) - 1;
 
 	struct fileOpenData {
 		struct Thread *thread;
@@ -88,6 +278,40 @@ extern "C" {
 		int numCallbacksNeeded;
 	};
 
+	// async request types
+	enum {
+		IO_READ,
+		IO_WRITE,
+		IO_SEEK,
+		IO_OPEN	// only on the fileIO thread, files are opened in the image
+	};
+
+	struct IORequest {
+		TVMIORequestID id;
+		int type;
+		bool done;
+		int result;
+		TVMThreadID waiter;	// thread blocked in VMIOWait on it, VM_THREAD_ID_INVALID if none
+		void *data;	// caller's buffer for a read
+		unsigned char *block;	// shared memory bounce block, NULL if the caller's buffer was leased shared memory
+		std::vector<uint8_t> copy;	// an image write's data, host side since the FAT code needs shared memory for its own transfers
+		int filedescriptor;	// the rest are only kept for the fileIO thread, which serves descriptors in the image
+		int length;	// offset for a seek
+		int whence;
+		char filename[VM_FILE_SYSTEM_MAX_PATH];	// for an open, with its flags and mode
+		int flags;
+		int mode;
+		int nextFree;	// next free request in the pool, -1 ends the list
+	};
+
+	struct CachedSector {
+		int sector;	// image sector held, -1 if the slot is empty
+		int prev;	// LRU list links, head is most recently used
+		int next;
+		bool dirty;	// newer than the image, written back on the next flush
+		uint8_t data[512];
+	};
+
 	struct fileSeekData {
 		struct Thread *thread;
 		int* curOffset;
@@ -98,33 +322,97 @@ extern "C" {
 		int* result;
 	};
 
+	// slot in a handle table, generation is bumped every time the slot is freed so stale IDs stop matching
+	struct HandleSlot {
+		void *object;	// NULL if the slot is free
+		uint16_t generation;
+		int nextFree;	// next slot on the free list, -1 at the end
+	};
+
+	struct HandleTable {
+		std::vector<struct HandleSlot> slots;
+		int freeHead;	// first free slot, -1 if every slot is in use
+		unsigned int count;
+	};
+
+	// intrusive link so a thread can sit in a queue without allocating, removal is O(1)
+	struct QueueLink {
+		struct QueueLink *next;
+		struct QueueLink *prev;
+		struct ThreadQueue *queue;	// queue the link is in, NULL if not queued
+		struct Thread *thread;
+	};
+
+	struct ThreadQueue {
+		struct QueueLink *head;
+		struct QueueLink *tail;
+		unsigned int size;
+	};
+
 	struct Thread {
 		TVMThreadEntry threadEntry;
 		void* parameter;
 		TVMMemorySize memsize;
-		TVMThreadPriority priority;
+		TVMThreadPriority priority;	// effective priority, can be boosted above basePriority by waiters on owned mutexes
+		TVMThreadPriority basePriority;	// priority it was created with
 		TVMThreadID tid;
 		TVMThreadState state;
 		SMachineContext context;
 		void* stack;
-		int sleepDuration;
-		int timeoutDuration;
-		std::queue<TVMMutexID> mutexesOwned;
+		TVMTick wakeTick;	// absolute tick to wake up at, only valid while timerIndex >= 0
+		int timerIndex;	// position in timerHeap, -1 if no timer is set
+		std::vector<TVMMutexID> mutexesOwned;
+		struct Mutex *blockedOn;	// mutex it is waiting in VMMutexAcquire for, NULL otherwise
+		TVMStatus waitStatus;	// set to success by whoever wakes it from a condition or semaphore, stays failure on timeout
+		struct QueueLink schedLink;	// ready, waitingThreads or waitingOnMemory
+		TVMMemorySize memoryWanted;	// block size it needs before leaving waitingOnMemory
+		int ioPending;	// Machine requests out whose callback data is on its stack, it can't be terminated until they're back
+		struct QueueLink waitLink;	// waitingMutex of the mutex it is blocked on
+		SVMThreadStats stats;
+		TVMTick stateTick;	// curTicks when the thread entered its current state
 	};
 
 	struct Mutex {
 		TVMThreadID owner;
 		bool unlocked;
 		TVMMutexID id;
-		std::queue<struct Thread*> waitingMutex;
+		struct ThreadQueue waitingMutex;
+	};
+
+	struct Condition {
+		TVMConditionID id;
+		struct ThreadQueue waiting;
 	};
 
+	struct Semaphore {
+		TVMSemaphoreID id;
+		unsigned int count;
+		struct ThreadQueue waiting;
+	};
 
-	struct SharedMemorySection {
-		bool unlocked;
-		void *startOfSection;
-		unsigned int sectionID;
-		int bytesUsed;
+	struct RWLock {
+		TVMRWLockID id;
+		unsigned int readers;	// threads holding it shared
+		TVMThreadID writer;	// thread holding it exclusive, VM_THREAD_ID_INVALID if none
+		struct ThreadQueue waitingReaders;
+		struct ThreadQueue waitingWriters;
+	};
+
+	// trace event types
+	enum {
+		TRACE_SWITCH,	// thread switched onto the CPU, arg is the thread switched off
+		TRACE_WAKE,	// waiting thread made ready
+		TRACE_IO_SUBMIT,	// arg is the file descriptor, NOT_SET for an open
+		TRACE_IO_COMPLETE,	// arg is the result
+		TRACE_MUTEX_ACQUIRE,	// arg is the mutex ID
+		TRACE_MUTEX_RELEASE	// arg is the mutex ID
+	};
+
+	struct TraceEvent {
+		TVMTick tick;
+		uint8_t type;
+		TVMThreadID thread;
+		uint32_t arg;
 	};
 
 	struct FatInfo {
@@ -163,6 +451,13 @@ extern "C" {
 		SVMDirectoryEntryRef entry;
 		uint16_t FstClusLO; // index for FATTable
 		int entryNum;
+		struct DirectoryEntry *hashNext;	// next entry in the same directoryIndex bucket
+	};
+
+	struct FileExtent {
+		int firstCluster;
+		int clusters;	// consecutive on the image and in the chain
+		unsigned int offset;	// byte offset in the file where the run starts
 	};
 
 	struct FileEntry {
@@ -172,12 +467,73 @@ extern "C" {
 		//int curLocation;
 		int curOffset;
 		int curCluster;
+		unsigned int position;	// byte offset in the file of curCluster and curOffset, moved along with them
 		int flags;
 		struct DirectoryEntry * rootEntry;
+		int lastCluster;	// cluster the previous read was in, 0 before the first read
+		int readaheadWindow;	// clusters kept fetched ahead of the reader, 0 while reads look random
+		std::deque<int> readaheadClusters;	// fetched ahead and not reached yet, in chain order
+		bool extentsBuilt;	// extents is filled in from the FAT the first time a seek needs it
+		std::vector<struct FileExtent> extents;	// the chain as runs of consecutive clusters, in file order
+		bool buffered;	// small writes collect in writeBuffer and reach the file together, see VMFileBuffered
+		std::vector<uint8_t> writeBuffer;	// cluster sized, holds bytes that go after curCluster and curOffset
+		int bufferedBytes;
 	};
 
 	volatile static TVMTick curTicks;
 	volatile static int interval;
+	static bool ticklessIdle = true;	// when only idle can run, alarm goes off at the next timer instead of every tick
+	static bool ticklessActive = false;
+	static TVMTick ticklessTicks;	// ticks the alarm was pushed out to
+	static struct timeval ticklessStart;
+
+	static void *freeStacks[numStackClasses];	// recycled stacks per size class, linked through their first word
+	static unsigned int stackPoolHits = 0;
+	static unsigned int stackPoolMisses = 0;
+	static TVMMemorySize stackPoolReserved = 0;	// bytes mapped for stacks, guard pages included
+	static bool stackPrefault = false;
+
+	// buddy allocator over shared memory, everything is indexed by memSectionSize unit from sharedMemoryStart
+	static std::vector<int8_t> buddyOrder;	// order of the block starting at a unit, -1 if no block starts there
+	static std::vector<bool> buddyFree;
+	static std::vector<int> buddyNext;	// free list links, -1 ends the list
+	static std::vector<int> buddyPrev;
+	static int buddyFreeHead[maxBuddyOrders];
+	static unsigned int buddyFreeCount[maxBuddyOrders];
+	static int buddyUnits = 0;
+	static TVMMemorySize sharedFreeBytes = 0;
+	static TVMMemorySize sharedPeakUsed = 0;
+	static TVMMemorySize sharedLargestBlock = 0;	// biggest block buddyInit made, nothing larger can ever be allocated
+	static std::vector<bool> sharedLeases;	// set at the first unit of blocks leased out by VMBufferAcquire
+
+	static struct IORequest ioRequests[maxIORequests];	// preallocated, only an image write's copy grows and it keeps its capacity
+	static int ioFreeHead = -1;
+	static std::deque<struct IORequest*> fileIOQueue;	// requests on image descriptors, oldest first
+	static struct ThreadQueue fileIOWaiting;	// fileIO thread when the queue is empty
+	static TVMThreadID fileIOThread;
+	static bool fileIOBusy = false;	// fileIO thread is part way through a request
+	static struct ThreadQueue fileIODrained;	// threads waiting for the queue to empty and the fileIO thread to go idle
+
+	static struct CachedSector sectorCache[sectorCacheSize];
+	static std::map<int, int> sectorCacheIndex;	// image sector to sectorCache slot
+	static int sectorCacheHead = -1;	// most recently used
+	static int sectorCacheTail = -1;	// least recently used, next to be reused
+	static unsigned int sectorCacheHits = 0;
+	static unsigned int sectorCacheMisses = 0;
+	static unsigned int sectorCacheEvictions = 0;
+	static unsigned int sectorCacheWrites = 0;	// sectors written to the image
+	static bool sectorWriteBack = true;	// WriteSector only dirties the cache, the image is updated on a flush
+	static TVMMutexID imageLock;	// keeps one thread's seek and transfer on fatFileDescriptor together
+	static TVMThreadID flusherThread;
+	static std::deque<int> readaheadQueue;	// clusters waiting for the prefetcher thread
+	static struct ThreadQueue readaheadWaiting;	// prefetcher thread when the queue is empty
+	static TVMThreadID prefetcherThread;
+	static unsigned int readaheadIssued = 0;	// clusters queued for readahead
+	static unsigned int readaheadHits = 0;	// of those, ones still cached when the reader got to them
+
+	static struct TraceEvent traceBuffer[traceBufferSize];
+	static unsigned int traceNext = 0;	// events recorded so far, next one goes in traceNext & (traceBufferSize - 1)
+	static bool traceEnabled = false;
 	static unsigned char* sharedMemoryStart;
 	static struct Thread *curThread = new struct Thread;
 	static struct Thread *mainThread = new struct Thread;
@@ -186,1453 +542,3730 @@ extern "C" {
 	static struct BPB *bpb;
 	static struct FatInfo *fatInformation = new struct FatInfo;
 	static std::vector<uint16_t> fatTable;
+	static std::vector<bool> clusterFree;	// one per cluster on the volume, true while its FAT entry is 0
+	static std::map<int, int> freeExtents;	// first cluster of each run of free clusters to the run's length
+	static std::set<std::pair<int, int> > freeExtentsBySize;	// the same runs as (length, first), for contiguous requests
+	static int clusterCursor = 2;	// next fit, single clusters are handed out from here on
 	static std::vector<struct DirectoryEntry*> rootDirectories;
 	static std::vector<uint8_t> rootData;
+	static std::vector<struct DirectoryEntry*> directoryIndex;	// buckets on the case folded short name, power of two long
+	static std::set<int> freeDirectorySlots;	// unused root entries, lowest first so the 0x00 end marker stays valid
 	static std::vector<struct FileEntry*> openFiles;
  	static int curFD = 3;
  	static int fatFileDescriptor;
  	static bool rootOpen = false;
  	static int curDirectoryDescriptor = 0;
 
-	std::queue<struct Thread*> readyIDLEThreads;
-	std::queue<struct Thread*> readyLowThreads;
-	std::queue<struct Thread*> readyNormalThreads;
-	std::queue<struct Thread*> readyHighThreads;
-	std::queue<struct Thread*> waitingThreads;
-	std::queue<struct Thread*> waitingOnMutex;
-	std::queue<struct Thread*> waitingOnMemory;
-
-	std::map<TVMThreadID, struct Thread*> allThreads;
-	std::map<TVMMutexID, struct Mutex*> allMutexes;
-
-	std::vector<struct SharedMemorySection*> sharedMemory;
-	std::queue<struct SharedMemorySection*> availableMemorySection;
-
-	void snapshot() {
-		std::cout << "CurThread ID" << std::endl;
-		std::cout << curThread->tid << std::endl;
-
-		std::cout << "" << std::endl;
-
-		std::cout << "In Low prio: " << std::endl;
-		int numLoops = readyLowThreads.size();
-				for (int i = 0; i < numLoops; i++) {
-					struct Thread *front = readyLowThreads.front();
-					readyLowThreads.pop();
-					std::cout << "Thread in Low" << std::endl;
-					std::cout << front->tid << std::endl;
-					std::cout << "Low Thread Status" << std::endl;
-					std::cout << front->state << std::endl;
-					readyLowThreads.push(front);
-				}
+	struct ThreadQueue readyThreads[VM_THREAD_PRIORITY_HIGH + 1];	// indexed by priority, 0 is the idle thread
+	unsigned int readyBitmap = 0;	// bit n is set when readyThreads[n] is not empty
+	struct ThreadQueue waitingThreads;
+	struct ThreadQueue waitingOnMemory;
 
+	std::vector<struct Thread*> timerHeap;	// min-heap on wakeTick of sleeping threads and timed mutex waits
 
-		std::cout << "In Normal prio: " << std::endl;
-		int numNormalLoops = readyNormalThreads.size();
-				for (int i = 0; i < numNormalLoops; i++) {
-					struct Thread *front = readyNormalThreads.front();
-					readyNormalThreads.pop();
-					std::cout << "Thread in Normal" << std::endl;
-					std::cout << front->tid << std::endl;
-					std::cout << "Normal Thread Status" << std::endl;
-					std::cout << front->state << std::endl;
-					readyNormalThreads.push(front);
-				}
+	struct HandleTable allThreads;
+	struct HandleTable allMutexes;
+	struct HandleTable allConditions;
+	struct HandleTable allSemaphores;
+	struct HandleTable allRWLocks;
+	struct HandleTable allIORequests;
 
-		std::cout << "In High Prio: " << std::endl;
-		int numHighLoops = readyHighThreads.size();
-		for (int i = 0; i < numHighLoops; i++) {
-					struct Thread *front = readyHighThreads.front();
-					readyHighThreads.pop();
-					std::cout << "Thread in High" << std::endl;
-					std::cout << front->tid << std::endl;
-					std::cout << "High Thread Status" << std::endl;
-					std::cout << front->state << std::endl;
-					readyHighThreads.push(front);
-				}
+	void handleTableInit(struct HandleTable *table) {
+		table->slots.clear();
+		table->freeHead = -1;
+		table->count = 0;
+	}
 
-		std::cout << "In Waiting" << std::endl;
-		int numWaitingLoops = waitingThreads.size();
-		for(int i = 0; i < numWaitingLoops; i++) {
-			struct Thread *front = waitingThreads.front();
-					waitingThreads.pop();
-					std::cout << "Thread in Waiting" << std::endl;
-					std::cout << front->tid << std::endl;
-					std::cout << "Waiting Thread Status" << std::endl;
-					std::cout << front->state << std::endl;
-					readyHighThreads.push(front);
+	unsigned int handleAlloc(struct HandleTable *table, void *object) {
+		unsigned int index;
+		if (table->freeHead >= 0) {
+			// reuse a freed slot, its generation was already bumped
+			index = table->freeHead;
+			table->freeHead = table->slots[index].nextFree;
+		} else {
+			index = table->slots.size();
+			if (index >= handleIndexMask) {
+				return VM_THREAD_ID_INVALID;	// out of slots, keeps the all ones ID free for invalid
+			}
+			struct HandleSlot newSlot;
+			newSlot.generation = 0;
+			table->slots.push_back(newSlot);
 		}
 
+		table->slots[index].object = object;
+		table->slots[index].nextFree = -1;
+		table->count += 1;
+		return ((unsigned int)table->slots[index].generation << handleIndexBits) | index;
 	}
 
-	void scheduler () {
+	void *handleLookup(struct HandleTable *table, unsigned int handle) {
+		unsigned int index = handle & handleIndexMask;
+		if (index >= table->slots.size()) {
+			return NULL;
+		}
 
-		struct Thread *nextThread = NULL;
+		struct HandleSlot *slot = &(table->slots[index]);
+		if (slot->generation != (handle >> handleIndexBits)) {
+			return NULL;	// slot has been freed (and maybe reused) since this ID was handed out
+		}
+		return slot->object;
+	}
 
-		if(!waitingOnMemory.empty() && !availableMemorySection.empty()) {
-			nextThread = waitingOnMemory.front();
-			waitingOnMemory.pop();
-			nextThread->state = VM_THREAD_STATE_READY;
-		} else if (!readyHighThreads.empty()) {
-			nextThread = readyHighThreads.front(); // get NextThread, will want to check priority in future
-			readyHighThreads.pop();				
-		} else if (!readyNormalThreads.empty()) {
-			nextThread = readyNormalThreads.front(); // get NextThread, will want to check priority in future
-			readyNormalThreads.pop();
-		} else if (!readyLowThreads.empty()) {
-			nextThread = readyLowThreads.front(); // get NextThread, will want to check priority in future
-			readyLowThreads.pop();
-		} else {
-			if (curThread->state != VM_THREAD_STATE_RUNNING) {
-				nextThread = readyIDLEThreads.front(); // get NextThread, will want to check priority in future
-				readyIDLEThreads.pop();
-			}
+	void handleFree(struct HandleTable *table, unsigned int handle) {
+		if (!handleLookup(table, handle)) {
+			return;
 		}
-		// if decide on a new thread, will change context
-		if (nextThread) {
 
-			if(curThread->priority > nextThread->priority && curThread->state == VM_THREAD_STATE_RUNNING) {
-				makeReady(nextThread);
-			} else {
-				// need to check here if need to push the nextThread back on to its ready queue or not
-				if (curThread->state == VM_THREAD_STATE_RUNNING) {
-					makeReady(curThread);
-				}
+		unsigned int index = handle & handleIndexMask;
+		table->slots[index].object = NULL;
+		table->slots[index].generation += 1;
+		table->slots[index].nextFree = table->freeHead;
+		table->freeHead = index;
+		table->count -= 1;
+	}
 
-				//switch machine context
-				SMachineContextRef prevContextRef = &(curThread->context);
-				curThread = nextThread;
-				nextThread->state = VM_THREAD_STATE_RUNNING;
-				removeFromReady(nextThread);
-				MachineContextSwitch(prevContextRef, &(nextThread->context));
+	int stackSizeClass(TVMMemorySize memsize) {
+		for (int i = 0; i < numStackClasses; i++) {
+			if ((pageSize << i) >= memsize) {
+				return i;
 			}
+		}
+		return -1;	// bigger than the largest class
+	}
+
+	void *stackAlloc(TVMMemorySize memsize) {
+		int stackClass = stackSizeClass(memsize);
+		if (stackClass < 0) {
+			return NULL;
+		}
+
+		if (freeStacks[stackClass]) {
+			// reuse a stack from a deleted thread, already mapped and faulted in
+			void *stack = freeStacks[stackClass];
+			freeStacks[stackClass] = *(void**)stack;
+			stackPoolHits += 1;
+			return stack;
+		}
 
+		// map the stack with one extra page below it, stack grows down so an overflow faults on the guard page
+		stackPoolMisses += 1;
+		size_t stackSize = pageSize << stackClass;
+		int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+		if (stackPrefault) {
+			mapFlags |= MAP_POPULATE;
+		}
+		unsigned char *region = (unsigned char*)mmap(NULL, stackSize + pageSize, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+		if (region == MAP_FAILED) {
+			return NULL;
 		}
+		mprotect(region, pageSize, PROT_NONE);
+		stackPoolReserved += stackSize + pageSize;
 
+		return region + pageSize;
 	}
 
-	void idle(void* param) {
-		MachineEnableSignals();
-		while(1){};
+	void stackFree(void *stack, TVMMemorySize memsize) {
+		int stackClass = stackSizeClass(memsize);
+		if (!stack || stackClass < 0) {
+			return;
+		}
+
+		// keep it mapped for the next thread of the same size class
+		*(void**)stack = freeStacks[stackClass];
+		freeStacks[stackClass] = stack;
 	}
 
-	void makeReady(struct Thread *thread) {
-		thread->state = VM_THREAD_STATE_READY;
+	void buddyInit(TVMMemorySize size) {
+		buddyUnits = size / memSectionSize;
+		buddyOrder.assign(buddyUnits, -1);
+		buddyFree.assign(buddyUnits, false);
+		buddyNext.assign(buddyUnits, -1);
+		buddyPrev.assign(buddyUnits, -1);
+		sharedLeases.assign(buddyUnits, false);
+		for (int order = 0; order < maxBuddyOrders; order++) {
+			buddyFreeHead[order] = -1;
+			buddyFreeCount[order] = 0;
+		}
+		sharedFreeBytes = 0;
+		sharedPeakUsed = 0;
+		sharedLargestBlock = 0;
+
+		// region doesn't have to be a power of two, cover it with the biggest aligned blocks that fit
+		int unit = 0;
+		while (unit < buddyUnits) {
+			int order = maxBuddyOrders - 1;
+			while (order > 0 && ((unit & ((1 << order) - 1)) != 0 || unit + (1 << order) > buddyUnits)) {
+				order--;
+			}
+			buddyPush(unit, order);
+			sharedFreeBytes += memSectionSize << order;
+			if ((memSectionSize << order) > sharedLargestBlock) {
+				sharedLargestBlock = memSectionSize << order;
+			}
+			unit += 1 << order;
+		}
+	}
 
-		if (thread->priority == 0x00) {
-			readyIDLEThreads.push(thread);
-		}	else if (thread->priority == VM_THREAD_PRIORITY_LOW) {
-			readyLowThreads.push(thread);
-		} else if (thread->priority == VM_THREAD_PRIORITY_NORMAL) {
-			readyNormalThreads.push(thread);
-		} else if (thread->priority == VM_THREAD_PRIORITY_HIGH)	{
-			readyHighThreads.push(thread);
+	void buddyPush(int unit, int order) {
+		buddyOrder[unit] = order;
+		buddyFree[unit] = true;
+		buddyPrev[unit] = -1;
+		buddyNext[unit] = buddyFreeHead[order];
+		if (buddyFreeHead[order] >= 0) {
+			buddyPrev[buddyFreeHead[order]] = unit;
 		}
+		buddyFreeHead[order] = unit;
+		buddyFreeCount[order] += 1;
+	}
 
+	void buddyRemove(int unit, int order) {
+		if (buddyPrev[unit] >= 0) {
+			buddyNext[buddyPrev[unit]] = buddyNext[unit];
+		} else {
+			buddyFreeHead[order] = buddyNext[unit];
+		}
+		if (buddyNext[unit] >= 0) {
+			buddyPrev[buddyNext[unit]] = buddyPrev[unit];
+		}
+		buddyFree[unit] = false;
+		buddyFreeCount[order] -= 1;
 	}
 
-	void makeWaiting(struct Thread *thread) {
+	void *sharedAlloc(TVMMemorySize size, TVMMemorySizeRef allocated) {
+		// smallest order that holds size
+		int want = 0;
+		while (want < maxBuddyOrders - 1 && (memSectionSize << want) < size) {
+			want++;
+		}
 
-		if (thread->state == VM_THREAD_STATE_READY) {
-			removeFromReady(thread);
+		int order = want;
+		while (order < maxBuddyOrders && buddyFreeHead[order] < 0) {
+			order++;
+		}
+		if (order == maxBuddyOrders) {
+			// nothing that big is free, hand out the biggest smaller block and let the caller split the transfer
+			order = want - 1;
+			while (order >= 0 && buddyFreeHead[order] < 0) {
+				order--;
+			}
+			if (order < 0) {
+				return NULL;
+			}
+			want = order;
 		}
 
-		thread->state = VM_THREAD_STATE_WAITING;
-		waitingThreads.push(thread);
+		// split down to the size wanted, upper halves go back on the free lists
+		int unit = buddyFreeHead[order];
+		buddyRemove(unit, order);
+		while (order > want) {
+			order--;
+			buddyPush(unit + (1 << order), order);
+		}
+		buddyOrder[unit] = want;
 
+		*allocated = memSectionSize << want;
+		sharedFreeBytes -= *allocated;
+		if (buddyUnits * memSectionSize - sharedFreeBytes > sharedPeakUsed) {
+			sharedPeakUsed = buddyUnits * memSectionSize - sharedFreeBytes;
+		}
+		return sharedMemoryStart + unit * memSectionSize;
 	}
 
-	void removeFromReady(struct Thread *thread) {
-		 if (thread->priority == VM_THREAD_PRIORITY_LOW) {
-				int numLoops = readyLowThreads.size();
-				for (int i = 0; i < numLoops; i++) {
-					struct Thread *front = readyLowThreads.front();
-					readyLowThreads.pop();
-					if(front->tid == thread->tid) {
-						//do no push,
-					} else {
-						readyLowThreads.push(front);
-					}
-				}
-			} else if (thread->priority == VM_THREAD_PRIORITY_NORMAL) {
-					int numLoops = readyNormalThreads.size();
-					for (int i = 0; i < numLoops; i++) {
-						struct Thread *front = readyNormalThreads.front();
-						readyNormalThreads.pop();
-						if(front->tid == thread->tid) {
-							//do no push,
-						} else {
-							readyNormalThreads.push(front);
-						}
-					}
-			} else if (thread->priority == VM_THREAD_PRIORITY_HIGH) {
-					int numLoops = readyHighThreads.size();
-					for (int i = 0; i < numLoops; i++) {
-						struct Thread *front = readyHighThreads.front();
-						readyHighThreads.pop();
-						if(front->tid == thread->tid) {
-							//do no push,
-						} else {
-							readyHighThreads.push(front);
-						}
-					}
-			}
-	}
+	void sharedFree(void *block) {
+		int unit = ((unsigned char*)block - sharedMemoryStart) / memSectionSize;
+		int order = buddyOrder[unit];
+		sharedFreeBytes += memSectionSize << order;
 
-	void removeFromWaiting(struct Thread *thread) {
-		int numLoops = waitingThreads.size();
-		for (int i = 0; i < numLoops; i++) {
-			struct Thread *front = waitingThreads.front();
-			waitingThreads.pop();
-			if(front->tid == thread->tid) {
-				//do no push,
-			} else {
-				waitingThreads.push(front);
+		// merge with the buddy for as long as it is free and the same size
+		while (order < maxBuddyOrders - 1) {
+			int buddy = unit ^ (1 << order);
+			if (buddy >= buddyUnits || !buddyFree[buddy] || buddyOrder[buddy] != order) {
+				break;
 			}
+			buddyRemove(buddy, order);
+			buddyOrder[buddy] = -1;
+			buddyOrder[unit] = -1;
+			if (buddy < unit) {
+				unit = buddy;
+			}
+			order++;
 		}
+		buddyPush(unit, order);
 	}
 
-	void removeFromOwned(struct Thread* thread, TVMMutexID mutex) {
-		int numLoops = thread->mutexesOwned.size();
-		for (int i = 0; i < numLoops; i++) {
-			TVMMutexID front = thread->mutexesOwned.front();
-			thread->mutexesOwned.pop();
-			if(front == mutex) {
-				//do no push,
-			} else {
-				thread->mutexesOwned.push(front);
+	TVMMemorySize sharedLargestFree() {
+		for (int order = maxBuddyOrders - 1; order >= 0; order--) {
+			if (buddyFreeHead[order] >= 0) {
+				return memSectionSize << order;
 			}
 		}
+		return 0;
 	}
 
-	void removeFromWaitingOnMutex(struct Thread *thread) {
-		int numLoops = waitingOnMutex.size();
-		for (int i = 0; i < numLoops; i++) {
-			struct Thread *front = waitingOnMutex.front();
-			waitingOnMutex.pop();
-			if(front->tid == thread->tid) {
-				//do no push,
-			} else {
-				waitingOnMutex.push(front);
+	// first thread on waitingOnMemory whose block is free now, a big request at the head doesn't hold up smaller ones
+	struct Thread *memoryWaiterFit() {
+		TVMMemorySize largestFree = sharedLargestFree();
+		for (struct QueueLink *link = waitingOnMemory.head; link; link = link->next) {
+			if (link->thread->memoryWanted <= largestFree) {
+				return link->thread;
 			}
 		}
+		return NULL;
 	}
 
-	void displayBPB(struct BPB *bpb) {
-		std::ios  state(NULL);
-		state.copyfmt(std::cout);
-		std::cout << "In BPB" << std::endl;
-		//std::cout << std::hex << *(bpb->jmpBoot) << std::endl;
-		std::cout << bpb->OEMName << std::endl;
-		std::cout << "BytesPerSec " << (int)bpb->BytesPerSec << std::endl;
-		std::cout << "SecPerClus " << (int)bpb->SecPerClus << std::endl;
-		std::cout << "ResvdSecCount " << (int)bpb->ResvdSecCount << std::endl;
-		std::cout << "NumFATs " << (int)bpb->NumFATs << std::endl;
-		std::cout << "RootEntCnt " << (int)bpb->RootEntCnt << std::endl;
-		std::cout << "TotSec16 " << (int)bpb->TotSec16 << std::endl;
-		std::cout << "Media " << (int)bpb->Media << std::endl;
-		std::cout << "FATSz16 " << (int)bpb->FATSz16 << std::endl;
-		std::cout << "SecPerTrk " << (int)bpb->SecPerTrk << std::endl;
-		std::cout << "NumHeads " << (int)bpb->NumHeads << std::endl;
-		std::cout << "HiddSec " << (int)bpb->HiddSec << std::endl;
-		std::cout << "TotSec32 " << (int)bpb->TotSec32 << std::endl;
-		std::cout << "DrvNum " << (int)bpb->DrvNum << std::endl;
-		std::cout << "Reserved1 " << (int)bpb->Reserved1 << std::endl;
-		std::cout << "BootSig " << (int)bpb->BootSig << std::endl;
-		std::cout << "VolID " << std::hex << bpb->VolID << std::endl;
-		std::cout << "VolLab " << bpb->VolLab << std::endl;
-		std::cout << "FilSysType " << (char*)bpb->FilSysType << std::endl;
-		std::cout.copyfmt(state);
-	}
-
-	void displayFatInfo(struct FatInfo *curInfo) {
-		std::ios  state(NULL);
-		state.copyfmt(std::cout);
+	bool sharedLeased(void *data, int length) {
+		// true if data through data + length sits inside one block leased with VMBufferAcquire
+		unsigned char *start = (unsigned char*)data;
+		if (!sharedMemoryStart || start < sharedMemoryStart || start >= sharedMemoryStart + buddyUnits * memSectionSize) {
+			return false;
+		}
 
-		std::cout << "pointer to fatInformation " << curInfo << std::endl;
-		std::cout << "RootDirectorySectors " << curInfo->RootDirectorySectors << std::endl;
-		std::cout << "FirstRootSector " << curInfo->FirstRootSector << std::endl;
-		std::cout << "FirstDataSector " << curInfo->FirstDataSector << std::endl;
-		std::cout << "ClusterCount " << curInfo->ClusterCount << std::endl;
-		std::cout.copyfmt(state);
+		int unit = (start - sharedMemoryStart) / memSectionSize;
+		while (unit > 0 && buddyOrder[unit] < 0) {
+			unit--;	// walk back to the start of the block data is in
+		}
+		if (!sharedLeases[unit]) {
+			return false;
+		}
+		return start + length <= sharedMemoryStart + (unit + (1 << buddyOrder[unit])) * memSectionSize;
 	}
 
-	void displayEntry(struct DirectoryEntry *dirEntry) {
-		std::ios  state(NULL);
-		state.copyfmt(std::cout);
+	TVMStatus VMBufferAcquire(TVMMemorySize size, void **bufferref) {
+		TMachineSignalState sigstate;
+		if (!bufferref || size == 0) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
 
-		  //   char DLongFileName[VM_FILE_SYSTEM_MAX_PATH];
-    // char DShortFileName[VM_FILE_SYSTEM_SFN_SIZE];
-    // unsigned int DSize;
-    // unsigned char DAttributes;
-    // SVMDateTime DCreate;
-    // SVMDateTime DAccess;
-    // SVMDateTime DModify;
+		MachineSuspendSignals(&sigstate);
+		// wait until a block big enough for all of it is free
+		TVMMemorySize blockSize = memSectionSize;
+		while (blockSize < size && blockSize <= sharedLargestBlock) {
+			blockSize <<= 1;
+		}
+		if (blockSize > sharedLargestBlock) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;	// could never be satisfied
+		}
+		while (sharedLargestFree() < blockSize) {
+			curThread->memoryWanted = blockSize;
+			queuePush(&waitingOnMemory, &(curThread->schedLink));
+			setState(curThread, VM_THREAD_STATE_WAITING);
+			scheduler();
+		}
 
-		std::cout << "ShortFileName: " << dirEntry->entry->DShortFileName << std::endl;
-		std::cout << "DSize: " << dirEntry->entry->DSize << std::endl;
-		std::cout << "DAttributes: " << dirEntry->entry->DAttributes << std::endl;
-		std::cout << "Created Date: " << (int)dirEntry->entry->DCreate.DMonth << "/" << (int)dirEntry->entry->DCreate.DDay << "/" << (int)dirEntry->entry->DCreate.DYear << std::endl;
-	 	std::cout << "Created Time: " << (int)dirEntry->entry->DCreate.DHour << ":" << (int)dirEntry->entry->DCreate.DMinute << ":" << (int)dirEntry->entry->DCreate.DSecond << std::endl;
-	 	std::cout << "Modified Date: " << (int)dirEntry->entry->DModify.DMonth << "/" << (int)dirEntry->entry->DModify.DDay << "/" << (int)dirEntry->entry->DModify.DYear << std::endl;
-	 	std::cout << "Modified Time: " << (int)dirEntry->entry->DModify.DHour << ":" << (int)dirEntry->entry->DModify.DMinute << ":" << (int)dirEntry->entry->DModify.DSecond << std::endl;
-		std::cout << "Accessed Date: " << (int)dirEntry->entry->DAccess.DMonth << "/" << (int)dirEntry->entry->DAccess.DDay << "/" << (int)dirEntry->entry->DAccess.DYear << std::endl;
+		unsigned char *buffer = (unsigned char*)sharedAlloc(size, &blockSize);
+		sharedLeases[(buffer - sharedMemoryStart) / memSectionSize] = true;
+		*bufferref = buffer;
 
-		std::cout.copyfmt(state);
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
 	}
- 
- 	void displayFile(struct FileEntry *fileEntry) {
- 		std::ios  state(NULL);
-		state.copyfmt(std::cout);
-
-		// int fileDescriptor;
-		// char* path;	// will want to memCpy path and name 
-		// char* name;
-		// //int curLocation;
-		// int curOffset;
-		// int curCluster;
-		// int flags;
 
-		displayEntry(fileEntry->rootEntry);
+	TVMStatus VMBufferRelease(void *buffer) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-		std::cout << "Filedescriptor: " << fileEntry->fileDescriptor << std::endl;
-		std::cout << "Path: " << (char*)fileEntry->path << std::endl;
-		std::cout << "Name: " << (char*)fileEntry->name << std::endl;
-		std::cout << "curOffset: " << fileEntry->curOffset << std::endl;
-		std::cout << "curCluster" << std::hex << fileEntry->curCluster << std::endl;
-		std::cout.copyfmt(state);
+		unsigned char *start = (unsigned char*)buffer;
+		int unit = (start - sharedMemoryStart) / memSectionSize;
+		if (!sharedMemoryStart || start < sharedMemoryStart || start >= sharedMemoryStart + buddyUnits * memSectionSize
+			|| start != sharedMemoryStart + unit * memSectionSize || !sharedLeases[unit]) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;	// not the start of a leased buffer
+		}
 
-		std::cout << "flags" << fileEntry->flags << std::endl;
- 	}
+		sharedLeases[unit] = false;
+		sharedFree(buffer);
 
-	TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int argc, char *argv[]) {
-		curTicks = 0;	// set curNum of Ticks
-		interval = tickms;	// set curNum of Milliseconds between Ticks
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-		TVMMainEntry entryPoint = VMLoadModule(argv[0]);
+	TVMStatus VMSharedMemoryQuery(SVMSharedMemoryStatsRef statsref) {
+		TMachineSignalState sigstate;
+		if (!statsref) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
 
-		if (entryPoint) {
-			// starting point = MachineIntialize(sharedsize);
-				sharedMemoryStart = (unsigned char*)MachineInitialize(sharedsize);
-				//calculate number of 512 shared memory sections
-				int pages = sharedsize/pageSize;
-				int leftover = sharedsize % pageSize;
-				if(leftover != 0) {
-					pages += 1;
-				}
+		MachineSuspendSignals(&sigstate);
+		statsref->DTotalBytes = buddyUnits * memSectionSize;
+		statsref->DFreeBytes = sharedFreeBytes;
+		statsref->DPeakUsedBytes = sharedPeakUsed;
+		statsref->DLargestFreeBytes = sharedLargestFree();
+		statsref->DFreeBlocks = 0;
+		for (int order = 0; order < maxBuddyOrders; order++) {
+			statsref->DFreeBlocks += buddyFreeCount[order];
+		}
+		statsref->DFragmentation = 0;
+		if (sharedFreeBytes > 0) {
+			statsref->DFragmentation = 100 - (unsigned int)((statsref->DLargestFreeBytes * 100) / sharedFreeBytes);
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-				int numSections = (pages * pageSize)/memSectionSize;
+	TVMStatus VMStackPoolQuery(unsigned int *hits, unsigned int *misses, TVMMemorySizeRef reserved) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		if (hits) {
+			*hits = stackPoolHits;
+		}
+		if (misses) {
+			*misses = stackPoolMisses;
+		}
+		if (reserved) {
+			*reserved = stackPoolReserved;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-				//create shared memory sections and add to vector
-				for (int i = 0; i < numSections; i++) {
-					struct SharedMemorySection* newSection = new SharedMemorySection;
-					newSection->unlocked = true;
-					newSection->startOfSection = sharedMemoryStart + (memSectionSize * i);
-					newSection->sectionID = i;
-					sharedMemory.push_back(newSection);
-					availableMemorySection.push(newSection);
-				}
+	TVMStatus VMStackPoolPrefault(int enable) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		stackPrefault = (enable != 0);	// only affects stacks mapped from now on
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-				MachineEnableSignals();
+	void queueLinkInit(struct QueueLink *link, struct Thread *thread) {
+		link->next = NULL;
+		link->prev = NULL;
+		link->queue = NULL;
+		link->thread = thread;
+	}
 
-				// set Idle Thread and put onto ready
-				// third argument is memsize
-				VMThreadCreate(&idle, NULL, 0x100000, ((TVMThreadPriority)0x00), &idleThread);
-				VMThreadActivate(idleThread);
+	void queueInit(struct ThreadQueue *queue) {
+		queue->head = NULL;
+		queue->tail = NULL;
+		queue->size = 0;
+	}
 
-				mainThread->priority = VM_THREAD_PRIORITY_NORMAL;	//for bookkeeping later
-				mainThread->state = VM_THREAD_STATE_RUNNING;
-				mainThread->tid = 1;
-				allThreads[mainThread->tid] = mainThread;
+	void queuePush(struct ThreadQueue *queue, struct QueueLink *link) {
+		// a link can only be in one queue at a time
+		if (link->queue) {
+			queueRemove(link);
+		}
 
-				curThread = mainThread;
+		link->next = NULL;
+		link->prev = queue->tail;
+		if (queue->tail) {
+			queue->tail->next = link;
+		} else {
+			queue->head = link;
+		}
+		queue->tail = link;
+		link->queue = queue;
+		queue->size += 1;
+	}
 
-				//Request for alarm at millisecond duration (convert to useconds_t)
-				useconds_t tickDurationUS = tickms * 1000;
-				MachineRequestAlarm(tickDurationUS, &alarmCallback, NULL);
+	void queueRemove(struct QueueLink *link) {
+		struct ThreadQueue *queue = link->queue;
+		if (!queue) {
+			return;	// not in a queue
+		}
+
+		if (link->prev) {
+			link->prev->next = link->next;
+		} else {
+			queue->head = link->next;
+		}
+		if (link->next) {
+			link->next->prev = link->prev;
+		} else {
+			queue->tail = link->prev;
+		}
+		link->next = NULL;
+		link->prev = NULL;
+		link->queue = NULL;
+		queue->size -= 1;
+	}
+
+	struct Thread *queuePop(struct ThreadQueue *queue) {
+		struct QueueLink *front = queue->head;
+		if (!front) {
+			return NULL;
+		}
+		queueRemove(front);
+		return front->thread;
+	}
+
+	struct Thread *queuePopHighest(struct ThreadQueue *queue) {
+		if (!queue->head) {
+			return NULL;
+		}
+
+		// first in the queue wins a tie so equal priorities stay FIFO
+		struct QueueLink *best = queue->head;
+		for (struct QueueLink *link = queue->head; link; link = link->next) {
+			if (link->thread->priority > best->thread->priority) {
+				best = link;
+			}
+		}
+		queueRemove(best);
+		return best->thread;
+	}
+
+	void setState(struct Thread *thread, TVMThreadState state) {
+		// charge the time since the last change to the state the thread is leaving
+		TVMTick elapsed = curTicks - thread->stateTick;
+		if (thread->state == VM_THREAD_STATE_RUNNING) {
+			thread->stats.DTicksRunning += elapsed;
+		} else if (thread->state == VM_THREAD_STATE_READY) {
+			thread->stats.DTicksReady += elapsed;
+		} else if (thread->state == VM_THREAD_STATE_WAITING) {
+			thread->stats.DTicksWaiting += elapsed;
+		}
+
+		thread->state = state;
+		thread->stateTick = curTicks;
+	}
+
+	TVMStatus VMThreadStats(TVMThreadID thread, SVMThreadStatsRef statsref) {
+		TMachineSignalState sigstate;
+		if (statsref) {
+			MachineSuspendSignals(&sigstate);
+			struct Thread *foundThread = (struct Thread*)handleLookup(&allThreads, thread);
+			if (!foundThread) {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_ID;
+			} else {
+				// include time in the current state without touching the thread
+				*statsref = foundThread->stats;
+				TVMTick elapsed = curTicks - foundThread->stateTick;
+				if (foundThread->state == VM_THREAD_STATE_RUNNING) {
+					statsref->DTicksRunning += elapsed;
+				} else if (foundThread->state == VM_THREAD_STATE_READY) {
+					statsref->DTicksReady += elapsed;
+				} else if (foundThread->state == VM_THREAD_STATE_WAITING) {
+					statsref->DTicksWaiting += elapsed;
+				}
+			}
+			MachineResumeSignals(&sigstate);
+		} else {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		return VM_STATUS_SUCCESS;
+	}
+
+	static inline void traceRecord(uint8_t type, TVMThreadID thread, uint32_t arg) {
+		if (!traceEnabled) {
+			return;
+		}
+
+		// oldest events get overwritten once the ring is full
+		struct TraceEvent *event = &(traceBuffer[traceNext & (traceBufferSize - 1)]);
+		event->tick = curTicks;
+		event->type = type;
+		event->thread = thread;
+		event->arg = arg;
+		traceNext += 1;
+	}
+
+	TVMStatus VMTraceEnable(int enable) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		traceEnabled = (enable != 0);
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMTraceExport(const char *filename) {
+		TMachineSignalState sigstate;
+		if (!filename) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		// written with host stdio so it doesn't go through the VM file calls it is tracing
+		FILE *traceFile = fopen(filename, "w");
+		if (!traceFile) {
+			return VM_STATUS_FAILURE;
+		}
+
+		MachineSuspendSignals(&sigstate);
+
+		unsigned int first = 0;
+		if (traceNext > traceBufferSize) {
+			first = traceNext - traceBufferSize;
+		}
+
+		// chrome trace format, timestamps in microseconds, events in the same tick are spread 1us apart to keep order
+		std::map<TVMThreadID, long> runningSince;
+		long lastTime = -1;
+		bool firstEvent = true;
+		fprintf(traceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		for (unsigned int i = first; i < traceNext; i++) {
+			struct TraceEvent *event = &(traceBuffer[i & (traceBufferSize - 1)]);
+			long time = (long)event->tick * interval * 1000;
+			if (time <= lastTime) {
+				time = lastTime + 1;
+			}
+			lastTime = time;
+
+			if (event->type == TRACE_SWITCH) {
+				// close the slice of the thread switched off and open one for the new thread
+				std::map<TVMThreadID, long>::iterator previous = runningSince.find(event->arg);
+				if (previous != runningSince.end()) {
+					fprintf(traceFile, "%s{\"name\":\"running\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%ld,\"dur\":%ld}", firstEvent ? "" : ",\n", event->arg, previous->second, time - previous->second);
+					firstEvent = false;
+					runningSince.erase(previous);
+				}
+				runningSince[event->thread] = time;
+				continue;
+			}
+
+			const char *name = "wake";
+			const char *argName = "thread";
+			if (event->type == TRACE_IO_SUBMIT) {
+				name = "io submit";
+				argName = "fd";
+			} else if (event->type == TRACE_IO_COMPLETE) {
+				name = "io complete";
+				argName = "result";
+			} else if (event->type == TRACE_MUTEX_ACQUIRE) {
+				name = "mutex acquire";
+				argName = "mutex";
+			} else if (event->type == TRACE_MUTEX_RELEASE) {
+				name = "mutex release";
+				argName = "mutex";
+			}
+			fprintf(traceFile, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%ld,\"args\":{\"%s\":%d}}", firstEvent ? "" : ",\n", name, event->thread, time, argName, (int)event->arg);
+			firstEvent = false;
+		}
+
+		// threads still on the CPU at the end of the trace
+		for (std::map<TVMThreadID, long>::iterator running = runningSince.begin(); running != runningSince.end(); ++running) {
+			fprintf(traceFile, "%s{\"name\":\"running\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%ld,\"dur\":%ld}", firstEvent ? "" : ",\n", running->first, running->second, lastTime - running->second);
+			firstEvent = false;
+		}
+		fprintf(traceFile, "\n]}\n");
+
+		MachineResumeSignals(&sigstate);
+
+		fclose(traceFile);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadStatsDump(void) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		// only reads the thread table, queues and thread states are left alone
+		std::cout << "CurThread ID " << curThread->tid << " at tick " << curTicks << std::endl;
+		for (unsigned int i = 0; i < allThreads.slots.size(); i++) {
+			struct Thread *thread = (struct Thread*)allThreads.slots[i].object;
+			if (!thread) {
+				continue;
+			}
+
+			SVMThreadStats stats;
+			VMThreadStats(thread->tid, &stats);
+			std::cout << "Thread " << thread->tid << " priority " << thread->priority << " state " << thread->state;
+			std::cout << " running " << stats.DTicksRunning << " ready " << stats.DTicksReady;
+			std::cout << " waiting " << stats.DTicksWaiting << " mutexWait " << stats.DTicksMutexWait;
+			std::cout << " switches " << stats.DContextSwitches << " boosts " << stats.DPriorityBoosts << std::endl;
+		}
+
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void scheduler () {
+
+		struct Thread *nextThread = NULL;
+
+		struct Thread *memoryWaiter = memoryWaiterFit();
+		if(memoryWaiter) {
+			nextThread = memoryWaiter;
+			queueRemove(&(nextThread->schedLink));
+			setState(nextThread, VM_THREAD_STATE_READY);
+		} else if ((readyBitmap >> VM_THREAD_PRIORITY_LOW) != 0) {
+			nextThread = popReady(); // highest priority that has a ready thread
+		} else {
+			if (curThread->state != VM_THREAD_STATE_RUNNING) {
+				nextThread = popReady(); // only the idle thread is left
+			}
+		}
+		// if decide on a new thread, will change context
+		if (nextThread) {
+
+			if(curThread->priority > nextThread->priority && curThread->state == VM_THREAD_STATE_RUNNING) {
+				makeReady(nextThread);
+			} else {
+				// need to check here if need to push the nextThread back on to its ready queue or not
+				if (curThread->state == VM_THREAD_STATE_RUNNING) {
+					makeReady(curThread);
+				}
+
+				if (nextThread->priority == VM_THREAD_PRIORITY_IDLE) {
+					ticklessEnter();
+				}
+
+				//switch machine context
+				SMachineContextRef prevContextRef = &(curThread->context);
+				traceRecord(TRACE_SWITCH, nextThread->tid, curThread->tid);
+				curThread = nextThread;
+				setState(nextThread, VM_THREAD_STATE_RUNNING);
+				nextThread->stats.DContextSwitches += 1;
+				MachineContextSwitch(prevContextRef, &(nextThread->context));
+			}
+
+		} else if (curThread->priority == VM_THREAD_PRIORITY_IDLE && curThread->state == VM_THREAD_STATE_RUNNING) {
+			ticklessEnter();	// woke up but there is still nothing to run
+		}
+
+	}
+
+	void idle(void* param) {
+		MachineEnableSignals();
+		while(1){
+			pause();	// block on the host until the alarm or a file callback comes in
+		};
+	}
+
+	void ticklessEnter() {
+		if (!ticklessIdle || ticklessActive) {
+			return;
+		}
+
+		// push the alarm out to the next timer, nothing can become ready before then except through a callback
+		ticklessTicks = maxTicklessTicks;
+		if (!timerHeap.empty()) {
+			TVMTick untilDeadline = timerHeap[0]->wakeTick - curTicks;
+			if ((int)untilDeadline < 1) {
+				untilDeadline = 1;
+			}
+			if (untilDeadline < ticklessTicks) {
+				ticklessTicks = untilDeadline;
+			}
+		}
+		if (ticklessTicks == 1) {
+			return;	// next tick is already the deadline
+		}
+
+		ticklessActive = true;
+		gettimeofday(&ticklessStart, NULL);
+		MachineRequestAlarm(ticklessTicks * interval * 1000, &alarmCallback, NULL);
+	}
+
+	void ticklessExit(bool alarmFired) {
+		if (!ticklessActive) {
+			return;
+		}
+		ticklessActive = false;
+
+		// catch curTicks up on the ticks that were skipped
+		if (alarmFired) {
+			curTicks += ticklessTicks;
+		} else {
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			long elapsedUS = ((now.tv_sec - ticklessStart.tv_sec) * 1000000) + (now.tv_usec - ticklessStart.tv_usec);
+			TVMTick elapsed = elapsedUS / (interval * 1000);
+			if (elapsed >= ticklessTicks) {
+				elapsed = ticklessTicks - 1;	// alarm hasn't gone off so the deadline hasn't been reached
+			}
+			curTicks += elapsed;
+		}
+
+		// back to periodic ticks now that a thread can run
+		MachineRequestAlarm(interval * 1000, &alarmCallback, NULL);
+	}
+
+	void callbackWake(struct Thread *thread) {
+		removeFromWaiting(thread);
+		makeReady(thread);
+
+		// VM was idle, run the woken thread now instead of waiting for the next tick
+		if (curThread->priority == VM_THREAD_PRIORITY_IDLE) {
+			ticklessExit(false);
+			scheduler();
+		}
+	}
+
+	TVMStatus VMTicklessIdle(int enable) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		ticklessIdle = (enable != 0);	// only idle can be in tickless mode so nothing to undo here
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void makeReady(struct Thread *thread) {
+		if (thread->priority > VM_THREAD_PRIORITY_HIGH) {
+			return;	// not a priority we schedule
+		}
+		if (thread->state == VM_THREAD_STATE_WAITING) {
+			traceRecord(TRACE_WAKE, thread->tid, thread->tid);
+		}
+		setState(thread, VM_THREAD_STATE_READY);
+
+		queuePush(&readyThreads[thread->priority], &(thread->schedLink));
+		readyBitmap |= (1u << thread->priority);
+	}
+
+	struct Thread *popReady() {
+		if (readyBitmap == 0) {
+			return NULL;
+		}
+
+		// highest set bit is the highest priority with a ready thread
+		unsigned int priority = 31 - __builtin_clz(readyBitmap);
+		struct Thread *thread = queuePop(&readyThreads[priority]);
+		if (readyThreads[priority].size == 0) {
+			readyBitmap &= ~(1u << priority);
+		}
+		return thread;
+	}
+
+	void makeWaiting(struct Thread *thread) {
+
+		if (thread->state == VM_THREAD_STATE_READY) {
+			removeFromReady(thread);
+		}
+
+		setState(thread, VM_THREAD_STATE_WAITING);
+		queuePush(&waitingThreads, &(thread->schedLink));
+
+	}
+
+	void removeFromReady(struct Thread *thread) {
+		struct ThreadQueue *queue = thread->schedLink.queue;
+		if (queue >= &readyThreads[0] && queue <= &readyThreads[VM_THREAD_PRIORITY_HIGH]) {
+			queueRemove(&(thread->schedLink));
+			if (queue->size == 0) {
+				readyBitmap &= ~(1u << (queue - readyThreads));
+			}
+		}
+	}
+
+	void removeFromWaiting(struct Thread *thread) {
+		if (thread->schedLink.queue == &waitingThreads) {
+			queueRemove(&(thread->schedLink));
+		}
+	}
+
+	void removeFromOwned(struct Thread* thread, TVMMutexID mutex) {
+		for (unsigned int i = 0; i < thread->mutexesOwned.size(); i++) {
+			if (thread->mutexesOwned[i] == mutex) {
+				thread->mutexesOwned.erase(thread->mutexesOwned.begin() + i);
+				return;
+			}
+		}
+	}
+
+	void setPriority(struct Thread *thread, TVMThreadPriority priority) {
+		if (thread->priority == priority) {
+			return;
+		}
+
+		// a ready thread has to move to the queue for its new priority
+		if (thread->state == VM_THREAD_STATE_READY && thread->schedLink.queue != &waitingOnMemory) {
+			removeFromReady(thread);
+			thread->priority = priority;
+			queuePush(&readyThreads[priority], &(thread->schedLink));
+			readyBitmap |= (1u << priority);
+		} else {
+			thread->priority = priority;
+		}
+	}
+
+	void priorityBoost(struct Thread *owner, TVMThreadPriority priority) {
+		// walk the chain of owners, an owner blocked on another mutex passes the boost along
+		while (owner && owner->priority < priority) {
+			setPriority(owner, priority);
+			owner->stats.DPriorityBoosts += 1;
+			if (!owner->blockedOn) {
+				break;
+			}
+			owner = (struct Thread*)handleLookup(&allThreads, owner->blockedOn->owner);
+		}
+	}
+
+	void priorityRestore(struct Thread *thread) {
+		while (thread) {
+			// highest of its own priority and every thread waiting on a mutex it still owns
+			TVMThreadPriority priority = thread->basePriority;
+			for (unsigned int i = 0; i < thread->mutexesOwned.size(); i++) {
+				struct Mutex *owned = (struct Mutex*)handleLookup(&allMutexes, thread->mutexesOwned[i]);
+				for (struct QueueLink *link = owned->waitingMutex.head; link; link = link->next) {
+					if (link->thread->priority > priority) {
+						priority = link->thread->priority;
+					}
+				}
+			}
+			if (priority >= thread->priority) {
+				return;	// nothing to lower, so nothing further down the chain changes either
+			}
+
+			setPriority(thread, priority);
+			if (!thread->blockedOn) {
+				return;
+			}
+			thread = (struct Thread*)handleLookup(&allThreads, thread->blockedOn->owner);
+		}
+	}
+
+	struct Thread *mutexNextOwner(struct Mutex *mutex) {
+		struct Thread *thread = queuePopHighest(&(mutex->waitingMutex));	// highest priority waiter gets the mutex
+		thread->blockedOn = NULL;
+		return thread;
+	}
+
+	void mutexRelease(struct Mutex *mutex, struct Thread *oldOwner) {
+		removeFromOwned(oldOwner, mutex->id);
+		traceRecord(TRACE_MUTEX_RELEASE, oldOwner->tid, mutex->id);
+
+		if (mutex->waitingMutex.size == 0) {
+			mutex->owner = -1; // no owner, need placeholder
+			mutex->unlocked = true;
+		} else {
+			struct Thread* nextOwner = mutexNextOwner(mutex);	// once released, get next owner
+			timerCancel(nextOwner);
+			nextOwner->mutexesOwned.push_back(mutex->id);
+			traceRecord(TRACE_MUTEX_ACQUIRE, nextOwner->tid, mutex->id);
+			mutex->owner = nextOwner->tid;
+			makeReady(nextOwner);
+		}
+
+		// drop whatever boost came from this mutex's waiters
+		priorityRestore(oldOwner);
+	}
+
+	void waitBlock(struct ThreadQueue *queue, TVMTick timeout) {
+		// current thread waits on a condition or semaphore until waitWake or the timeout
+		curThread->waitStatus = VM_STATUS_FAILURE;
+		queuePush(queue, &(curThread->waitLink));
+		if (timeout != VM_TIMEOUT_INFINITE) {
+			timerAdd(curThread, timeout);
+		}
+		setState(curThread, VM_THREAD_STATE_WAITING);
+		scheduler();
+	}
+
+	void waitWake(struct Thread *thread) {
+		// caller has already taken it off the wait queue
+		thread->waitStatus = VM_STATUS_SUCCESS;
+		timerCancel(thread);
+		makeReady(thread);
+	}
+
+	void mutexWaitCancel(struct Thread *thread) {
+		struct Mutex *mutex = thread->blockedOn;
+		if (!mutex) {
+			return;
+		}
+
+		// gave up waiting, the owner no longer needs the priority this thread lent it
+		queueRemove(&(thread->waitLink));
+		thread->blockedOn = NULL;
+		priorityRestore((struct Thread*)handleLookup(&allThreads, mutex->owner));
+	}
+
+	// true if tick a comes before tick b, works across TVMTick wrapping around
+	bool tickBefore(TVMTick a, TVMTick b) {
+		return (int)(a - b) < 0;
+	}
+
+	void timerSwap(unsigned int first, unsigned int second) {
+		struct Thread *temp = timerHeap[first];
+		timerHeap[first] = timerHeap[second];
+		timerHeap[second] = temp;
+		timerHeap[first]->timerIndex = first;
+		timerHeap[second]->timerIndex = second;
+	}
+
+	void timerSiftUp(unsigned int index) {
+		while (index > 0) {
+			unsigned int parent = (index - 1) / 2;
+			if (!tickBefore(timerHeap[index]->wakeTick, timerHeap[parent]->wakeTick)) {
+				break;
+			}
+			timerSwap(index, parent);
+			index = parent;
+		}
+	}
+
+	void timerSiftDown(unsigned int index) {
+		unsigned int size = timerHeap.size();
+		while (true) {
+			unsigned int earliest = index;
+			unsigned int left = (2 * index) + 1;
+			unsigned int right = left + 1;
+			if (left < size && tickBefore(timerHeap[left]->wakeTick, timerHeap[earliest]->wakeTick)) {
+				earliest = left;
+			}
+			if (right < size && tickBefore(timerHeap[right]->wakeTick, timerHeap[earliest]->wakeTick)) {
+				earliest = right;
+			}
+			if (earliest == index) {
+				break;
+			}
+			timerSwap(index, earliest);
+			index = earliest;
+		}
+	}
+
+	void timerAdd(struct Thread *thread, TVMTick ticks) {
+		timerCancel(thread);	// only one timer per thread
+
+		thread->wakeTick = curTicks + ticks;
+		thread->timerIndex = timerHeap.size();
+		timerHeap.push_back(thread);
+		timerSiftUp(thread->timerIndex);
+	}
+
+	void timerCancel(struct Thread *thread) {
+		if (thread->timerIndex < 0) {
+			return;	// no timer set
+		}
+
+		// move last timer into the hole and fix the heap around it
+		unsigned int index = thread->timerIndex;
+		unsigned int last = timerHeap.size() - 1;
+		if (index != last) {
+			timerSwap(index, last);
+		}
+		timerHeap.pop_back();
+		thread->timerIndex = -1;
+
+		if (index < timerHeap.size()) {
+			timerSiftUp(index);
+			timerSiftDown(index);
+		}
+	}
+
+	void timerExpire() {
+		// only look at timers that are due, earliest is always at the top
+		while (!timerHeap.empty() && !tickBefore(curTicks, timerHeap[0]->wakeTick)) {
+			struct Thread *expired = timerHeap[0];
+			timerCancel(expired);
+
+			mutexWaitCancel(expired);	// timed out waiting on a mutex, make ready to try one last acquire
+			queueRemove(&(expired->waitLink));	// timed out on a condition or semaphore, waitStatus stays failure
+			removeFromWaiting(expired);	// done sleeping
+			makeReady(expired);
+		}
+	}
+
+	void displayBPB(struct BPB *bpb) {
+		std::ios  state(NULL);
+		state.copyfmt(std::cout);
+		std::cout << "In BPB" << std::endl;
+		//std::cout << std::hex << *(bpb->jmpBoot) << std::endl;
+		std::cout << bpb->OEMName << std::endl;
+		std::cout << "BytesPerSec " << (int)bpb->BytesPerSec << std::endl;
+		std::cout << "SecPerClus " << (int)bpb->SecPerClus << std::endl;
+		std::cout << "ResvdSecCount " << (int)bpb->ResvdSecCount << std::endl;
+		std::cout << "NumFATs " << (int)bpb->NumFATs << std::endl;
+		std::cout << "RootEntCnt " << (int)bpb->RootEntCnt << std::endl;
+		std::cout << "TotSec16 " << (int)bpb->TotSec16 << std::endl;
+		std::cout << "Media " << (int)bpb->Media << std::endl;
+		std::cout << "FATSz16 " << (int)bpb->FATSz16 << std::endl;
+		std::cout << "SecPerTrk " << (int)bpb->SecPerTrk << std::endl;
+		std::cout << "NumHeads " << (int)bpb->NumHeads << std::endl;
+		std::cout << "HiddSec " << (int)bpb->HiddSec << std::endl;
+		std::cout << "TotSec32 " << (int)bpb->TotSec32 << std::endl;
+		std::cout << "DrvNum " << (int)bpb->DrvNum << std::endl;
+		std::cout << "Reserved1 " << (int)bpb->Reserved1 << std::endl;
+		std::cout << "BootSig " << (int)bpb->BootSig << std::endl;
+		std::cout << "VolID " << std::hex << bpb->VolID << std::endl;
+		std::cout << "VolLab " << bpb->VolLab << std::endl;
+		std::cout << "FilSysType " << (char*)bpb->FilSysType << std::endl;
+		std::cout.copyfmt(state);
+	}
+
+	void displayFatInfo(struct FatInfo *curInfo) {
+		std::ios  state(NULL);
+		state.copyfmt(std::cout);
+
+		std::cout << "pointer to fatInformation " << curInfo << std::endl;
+		std::cout << "RootDirectorySectors " << curInfo->RootDirectorySectors << std::endl;
+		std::cout << "FirstRootSector " << curInfo->FirstRootSector << std::endl;
+		std::cout << "FirstDataSector " << curInfo->FirstDataSector << std::endl;
+		std::cout << "ClusterCount " << curInfo->ClusterCount << std::endl;
+		std::cout.copyfmt(state);
+	}
+
+	void displayEntry(struct DirectoryEntry *dirEntry) {
+		std::ios  state(NULL);
+		state.copyfmt(std::cout);
+
+		  //   char DLongFileName[VM_FILE_SYSTEM_MAX_PATH];
+    // char DShortFileName[VM_FILE_SYSTEM_SFN_SIZE];
+    // unsigned int DSize;
+    // unsigned char DAttributes;
+    // SVMDateTime DCreate;
+    // SVMDateTime DAccess;
+    // SVMDateTime DModify;
+
+		std::cout << "ShortFileName: " << dirEntry->entry->DShortFileName << std::endl;
+		std::cout << "DSize: " << dirEntry->entry->DSize << std::endl;
+		std::cout << "DAttributes: " << dirEntry->entry->DAttributes << std::endl;
+		std::cout << "Created Date: " << (int)dirEntry->entry->DCreate.DMonth << "/" << (int)dirEntry->entry->DCreate.DDay << "/" << (int)dirEntry->entry->DCreate.DYear << std::endl;
+	 	std::cout << "Created Time: " << (int)dirEntry->entry->DCreate.DHour << ":" << (int)dirEntry->entry->DCreate.DMinute << ":" << (int)dirEntry->entry->DCreate.DSecond << std::endl;
+	 	std::cout << "Modified Date: " << (int)dirEntry->entry->DModify.DMonth << "/" << (int)dirEntry->entry->DModify.DDay << "/" << (int)dirEntry->entry->DModify.DYear << std::endl;
+	 	std::cout << "Modified Time: " << (int)dirEntry->entry->DModify.DHour << ":" << (int)dirEntry->entry->DModify.DMinute << ":" << (int)dirEntry->entry->DModify.DSecond << std::endl;
+		std::cout << "Accessed Date: " << (int)dirEntry->entry->DAccess.DMonth << "/" << (int)dirEntry->entry->DAccess.DDay << "/" << (int)dirEntry->entry->DAccess.DYear << std::endl;
+
+		std::cout.copyfmt(state);
+	}
+ 
+ 	void displayFile(struct FileEntry *fileEntry) {
+ 		std::ios  state(NULL);
+		state.copyfmt(std::cout);
+
+		// int fileDescriptor;
+		// char* path;	// will want to memCpy path and name 
+		// char* name;
+		// //int curLocation;
+		// int curOffset;
+		// int curCluster;
+		// int flags;
+
+		displayEntry(fileEntry->rootEntry);
+
+		std::cout << "Filedescriptor: " << fileEntry->fileDescriptor << std::endl;
+		std::cout << "Path: " << (char*)fileEntry->path << std::endl;
+		std::cout << "Name: " << (char*)fileEntry->name << std::endl;
+		std::cout << "curOffset: " << fileEntry->curOffset << std::endl;
+		std::cout << "curCluster" << std::hex << fileEntry->curCluster << std::endl;
+		std::cout.copyfmt(state);
+
+		std::cout << "flags" << fileEntry->flags << std::endl;
+ 	}
+
+	TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int argc, char *argv[]) {
+		curTicks = 0;	// set curNum of Ticks
+		interval = tickms;	// set curNum of Milliseconds between Ticks
+
+		TVMMainEntry entryPoint = VMLoadModule(argv[0]);
+
+		if (entryPoint) {
+				handleTableInit(&allThreads);
+				handleTableInit(&allMutexes);
+				handleTableInit(&allConditions);
+				handleTableInit(&allSemaphores);
+				handleTableInit(&allRWLocks);
+				handleTableInit(&allIORequests);
+				for (int i = 0; i < maxIORequests; i++) {
+					ioRequests[i].nextFree = (i + 1 < maxIORequests) ? i + 1 : -1;
+				}
+				ioFreeHead = 0;
+
+			// starting point = MachineIntialize(sharedsize);
+				sharedMemoryStart = (unsigned char*)MachineInitialize(sharedsize);
+				//calculate number of 512 shared memory sections
+				int pages = sharedsize/pageSize;
+				int leftover = sharedsize % pageSize;
+				if(leftover != 0) {
+					pages += 1;
+				}
+
+				buddyInit(pages * pageSize);
+
+				MachineEnableSignals();
+
+				// set Idle Thread and put onto ready
+				// third argument is memsize
+				VMThreadCreate(&idle, NULL, 0x100000, VM_THREAD_PRIORITY_IDLE, &idleThread);
+				VMThreadActivate(idleThread);
+
+				mainThread->priority = VM_THREAD_PRIORITY_NORMAL;	//for bookkeeping later
+				mainThread->basePriority = VM_THREAD_PRIORITY_NORMAL;
+				mainThread->blockedOn = NULL;
+				mainThread->ioPending = 0;
+				mainThread->state = VM_THREAD_STATE_RUNNING;
+				memset(&(mainThread->stats), 0, sizeof(SVMThreadStats));
+				mainThread->stateTick = curTicks;
+				queueLinkInit(&(mainThread->schedLink), mainThread);
+				queueLinkInit(&(mainThread->waitLink), mainThread);
+				mainThread->timerIndex = -1;
+				mainThread->tid = handleAlloc(&allThreads, mainThread);
+
+				curThread = mainThread;
+
+				//Request for alarm at millisecond duration (convert to useconds_t)
+				useconds_t tickDurationUS = tickms * 1000;
+				MachineRequestAlarm(tickDurationUS, &alarmCallback, NULL);
 
 				// create vector with 512 uint_8 entries for each byte of the BPB, read in directly after into BPB
 				InternalFileOpen(mount, O_RDWR, 0600, &fatFileDescriptor);
+				VMMutexCreate(&imageLock);
+				sectorCacheInit();
 				uint8_t BPBbuffer[512];
 
-				ReadSector(0, BPBbuffer);
-				bpb = (struct BPB*)BPBbuffer; // put BPB info into struct
+				ReadSector(0, BPBbuffer);
+				bpb = (struct BPB*)BPBbuffer; // put BPB info into struct
+
+				fatInformation->FirstRootSector = bpb->ResvdSecCount + (bpb->NumFATs * bpb->FATSz16);
+				fatInformation->RootDirectorySectors = (bpb->RootEntCnt * 32) / 512;
+				fatInformation->FirstDataSector = fatInformation->FirstRootSector + fatInformation->RootDirectorySectors;
+				unsigned int totalSectors = (bpb->TotSec16 != 0) ? bpb->TotSec16 : bpb->TotSec32;	// TotSec32 is 0 on small volumes
+				fatInformation->ClusterCount = (totalSectors - fatInformation->FirstDataSector) / bpb->SecPerClus;
+
+				//displayBPB(bpb);
+				//displayFatInfo(fatInformation);
+
+				//read in FAT (will be number of sectors in Fat = BPB_FatSz16, copy into FAT)
+				int numEntries = bpb->FATSz16 * 256; // had originally * 256
+				//uint16_t fatTable[numEntries];
+				fatTable.resize(numEntries);
+
+				for(int i = 0; i < bpb->FATSz16; i++) {
+					int secNum = 1 + i;
+					uint8_t fatTableSector[512];
+					ReadSector(secNum, fatTableSector);
+					int index = 256 * i;
+					memcpy(&fatTable[index], fatTableSector, 512);
+				}
+				freeSpaceInit();
+
+				// for (int i = 0; i < numEntries; i++) {
+				// 	std::ios  state(NULL);
+				//  	state.copyfmt(std::cout);
+				//  	std::cout << std::hex << fatTable[i] << " " << std::endl;
+				//  	std::cout.copyfmt(state);
+				//  }
+
+				// read in root directory, for each file (32 bytes), read in info, then store in rootDirectories
+				int rootSize = fatInformation->RootDirectorySectors * 512;
+				rootData.resize(rootSize);
+				for(unsigned int i = 0; i < fatInformation->RootDirectorySectors; i++) {
+					int secNum = fatInformation->FirstRootSector + i;
+					uint8_t rootSector[512];
+					ReadSector(secNum, rootSector);
+					int index = 512 * i;
+					memcpy(&rootData[index], rootSector, 512);
+				}
+				// read in info, store in rootDirectories
+				for(int i = 0; i < rootSize; i += 32) {
+					if (rootData[i] == 0xE5) {
+						continue;	// deleted entry
+					} else if (rootData[i] != 0x00) { //see if empty file !!!!! MAY NOT BE CORRECT MAY NEED TO BE MORE SPECIFIC!!!!!!
+						//read into a Directory struct
+						//check if LongEntry
+
+						struct DirectoryEntry* fullEntry = new struct DirectoryEntry;
+						SVMDirectoryEntryRef newEntry = new SVMDirectoryEntry;
+						memcpy(&(newEntry->DAttributes), &rootData[i+11], 1);
+
+						if ((newEntry->DAttributes & VM_FILE_SYSTEM_ATTR_LONG_NAME_MASK) == VM_FILE_SYSTEM_ATTR_LONG_NAME) {
+							continue;
+						} else {
+							// need to put in bytes here... with bitwise operators
+							// bitFunction(&(newEntry->DCreate), 2 bytes)
+							// bitFunction(DVMDateREf, bytes)
+							fullEntry->entryNum = (int)(i / 32);
+							memcpy(&(newEntry->DShortFileName), &rootData[i], 11);
+							// Not passing right thing
+							uint16_t* dateCrtData = (uint16_t*)&(rootData[i+16]);
+							uint16_t* timeCrtData = (uint16_t*)&(rootData[i+14]);
+							setDateStruct(&(newEntry->DCreate), *dateCrtData, *timeCrtData);
+
+							uint16_t* dateModData = (uint16_t*)&(rootData[i+24]);
+							uint16_t* timeModData = (uint16_t*)&(rootData[i+22]);
+							setDateStruct(&(newEntry->DModify), *dateModData, *timeModData);
+
+							uint16_t* dateAccData = (uint16_t*)&(rootData[i+18]);
+							setDateAccess(&(newEntry->DAccess), *dateAccData);
+							//FstClusLO
+							memcpy(&(newEntry->DSize), &rootData[i+28], 4);
+							fullEntry->entry = newEntry;
+							memcpy(&(fullEntry->FstClusLO), &rootData[i+26], 2);
+							//add to list of directories
+							rootDirectories.push_back(fullEntry);
+						}
+
+					} else {
+						break;
+					}
+				}
+
+				directoryIndexInit();
+
+				openFiles.push_back(NULL);	// set openFiles, 0, 1, 2 all to NULL (not applicable)
+				openFiles.push_back(NULL);
+				openFiles.push_back(NULL);
+
+				VMThreadCreate(&flusher, NULL, 0x100000, VM_THREAD_PRIORITY_LOW, &flusherThread);
+				VMThreadActivate(flusherThread);
+				// high so a queued cluster's read is submitted before the reader gets going again
+				VMThreadCreate(&prefetcher, NULL, 0x100000, VM_THREAD_PRIORITY_HIGH, &prefetcherThread);
+				VMThreadActivate(prefetcherThread);
+				// high for the same reason, an async request gets as far as waiting on the image before the caller carries on
+				VMThreadCreate(&fileIOWorker, NULL, 0x100000, VM_THREAD_PRIORITY_HIGH, &fileIOThread);
+				VMThreadActivate(fileIOThread);
+
+				// for (int i =0; i < rootDirectories.size(); i++) {
+				// 	std::cout << "FileName: " << rootDirectories[i]->entry->DShortFileName << std::endl;
+				// 	std::cout << "FileSize: " << rootDirectories[i]->entry->DSize << std::endl;
+				// 	std::cout << "Created Date: " << (int)rootDirectories[i]->entry->DCreate.DMonth << "/" << (int)rootDirectories[i]->entry->DCreate.DDay << "/" << (int)rootDirectories[i]->entry->DCreate.DYear << std::endl;
+				// 	std::cout << "Created Time: " << (int)rootDirectories[i]->entry->DCreate.DHour << ":" << (int)rootDirectories[i]->entry->DCreate.DMinute << ":" << (int)rootDirectories[i]->entry->DCreate.DSecond << std::endl;
+				// 	std::cout << "FstClusLO: " << rootDirectories[i]->FstClusLO << std::endl;
+				// }
+
+				(*entryPoint)(argc, argv);
+
+				// async writes the program didn't wait for go in before the final flush, then the files it left open
+				// still have their buffered writes
+				TMachineSignalState sigstate;
+				MachineSuspendSignals(&sigstate);
+				while (!fileIOQueue.empty() || fileIOBusy) {
+					waitBlock(&fileIODrained, VM_TIMEOUT_INFINITE);
+				}
+				for (unsigned int i = 3; i < openFiles.size(); i++) {
+					if (openFiles[i]) {
+						fileFlush(openFiles[i]);
+					}
+				}
+				MachineResumeSignals(&sigstate);
+				sectorCacheFlush();
+				InternalFileClose(fatFileDescriptor);
+				MachineTerminate();
+				VMUnloadModule();
+		} else {
+			return VM_STATUS_FAILURE;
+		}
+
+		return VM_STATUS_SUCCESS;
+
+	}	
+
+	// the read-only getters below don't suspend signals, a single aligned word read can't see a half written value
+	// and the handler that writes it runs on the same host thread, so there's nothing to lock against
+	TVMStatus VMTickMS(int *tickmsref) {
+		if (!tickmsref) {	// location doesn't exist
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		*tickmsref = interval;	// only set once in VMStart
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMTickCount(TVMTickRef tickref) {
+		if (!tickref) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		*tickref = curTicks;	// volatile, so this is always a fresh load
+		return VM_STATUS_SUCCESS;
+	}
+
+	void alarmCallback(void *calldata) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		if (ticklessActive) {
+			ticklessExit(true);	// adds all the ticks the alarm was pushed out by
+		} else {
+			curTicks += 1;	// add tick
+		}
+
+		// wake sleeping threads and timed out mutex waits whose tick has come
+		timerExpire();
+
+		
+		scheduler();
+
+		MachineResumeSignals(&sigstate);
+
+	
+	}
+
+	TVMStatus VMThreadSleep(TVMTick tick) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		if (tick == VM_TIMEOUT_INFINITE) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		} else if (tick == VM_TIMEOUT_IMMEDIATE) {
+			// yield rest of time to process of next highest priority
+			MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+
+		}
+		else {
+			makeWaiting(curThread);
+			timerAdd(curThread, tick);
+			scheduler();	// Not sure if need to call here since scheduler is called every tick
+
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_SUCCESS;
+		}	
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsize, TVMThreadPriority prio, TVMThreadIDRef tid) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		if(tid && entry && prio <= VM_THREAD_PRIORITY_HIGH) {
+			// make new thread
+			struct Thread *newThread = new struct Thread;
+			queueLinkInit(&(newThread->schedLink), newThread);
+			queueLinkInit(&(newThread->waitLink), newThread);
+			newThread->timerIndex = -1;
+			newThread->threadEntry = entry;
+			newThread->parameter = param;
+			newThread->memsize = memsize;
+			newThread->stack = NULL;
+			newThread->priority = prio;
+			newThread->basePriority = prio;
+			newThread->blockedOn = NULL;
+			newThread->ioPending = 0;
+			newThread->state = VM_THREAD_STATE_DEAD;
+			memset(&(newThread->stats), 0, sizeof(SVMThreadStats));
+			newThread->stateTick = curTicks;
+			newThread->tid = handleAlloc(&allThreads, newThread);
+
+			if (newThread->tid == VM_THREAD_ID_INVALID) {
+				delete newThread;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;	// no more thread IDs
+			}
+			*tid = newThread->tid;
+
+		} else {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadState(TVMThreadID thread, TVMThreadStateRef stateref) {
+		TMachineSignalState sigstate;
+		if (stateref) {	
+			MachineSuspendSignals(&sigstate);		// suspend and resume here to limit scope
+			struct Thread *foundThread = (struct Thread*)handleLookup(&allThreads, thread);
+			if (!foundThread) {
+				MachineResumeSignals(&sigstate);	//stateref is valid but thread does not exist
+				return VM_STATUS_ERROR_INVALID_ID;
+			} else {
+				*stateref = foundThread->state;		//stateref is valid and thread exists
+			}
+			MachineResumeSignals(&sigstate);
+		} else {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadActivate(TVMThreadID thread) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		struct Thread *foundThread = (struct Thread*)handleLookup(&allThreads, thread);
+		if (!foundThread) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+			if (foundThread->state == VM_THREAD_STATE_DEAD) {
+				// activate thread (create machine context), a thread activated again keeps its old stack
+				if (foundThread->memsize != 0 && !foundThread->stack) {
+					foundThread->stack = stackAlloc(foundThread->memsize);
+					if (!foundThread->stack) {
+						MachineResumeSignals(&sigstate);
+						return VM_STATUS_FAILURE;	// could not map a stack
+					}
+				}
+
+				MachineContextCreate(&(foundThread->context), &skeleton, foundThread->parameter, foundThread->stack, foundThread->memsize);
+
+				// put into ready state change curThread state to READY
+				makeReady(foundThread);
+				if(foundThread->priority > curThread->priority) {
+					scheduler();
+				}
+
+			} else {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_STATE;
+			}
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadID(TVMThreadIDRef threadref) {
+		if (!threadref) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		// no suspend needed, a switch away and back always lands on this same thread so curThread reads as itself
+		*threadref = curThread->tid;
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMThreadTerminate(TVMThreadID thread) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		struct Thread *foundThread = (struct Thread*)handleLookup(&allThreads, thread);
+		if (!foundThread) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+				if (foundThread->state == VM_THREAD_STATE_DEAD) { //if thread is already dead
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_ERROR_INVALID_STATE;
+				} else if (foundThread->ioPending > 0) {
+					// the callbacks would write into its stack and wake it after it has been reused or deleted
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_ERROR_INVALID_STATE;
+				} else {
+					if (foundThread->state == VM_THREAD_STATE_READY) {
+						removeFromReady(foundThread);
+					} else if (foundThread->state == VM_THREAD_STATE_WAITING) {
+						removeFromWaiting(foundThread);
+						queueRemove(&(foundThread->schedLink));	// waitingOnMemory
+						mutexWaitCancel(foundThread);	// waitingMutex of a mutex
+						queueRemove(&(foundThread->waitLink));	// waiting of a condition or semaphore
+					}
+					// a thread woken by a callback is ready with its timeout still set until it runs
+					timerCancel(foundThread);
+
+					setState(foundThread, VM_THREAD_STATE_DEAD);	// change state to dead, may not be applicable for IDLE
+
+					// release any mutexes that are owned, mutexRelease takes each off the owned list
+					while (!foundThread->mutexesOwned.empty()) {
+						struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, foundThread->mutexesOwned.back());
+						mutexRelease(foundMutex, foundThread);
+					}
+					setPriority(foundThread, foundThread->basePriority);	// owns nothing now, drop any boost
+
+					if (foundThread->tid == curThread->tid) { // if thread that is being terminated is current thread
+						scheduler();	// schedule new thread
+					}
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_SUCCESS;
+				}	
+			}	
+	}
+
+	TVMStatus VMThreadDelete(TVMThreadID thread) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		struct Thread *foundThread = (struct Thread*)handleLookup(&allThreads, thread);
+		if (!foundThread) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+			if (foundThread->state == VM_THREAD_STATE_DEAD) {
+				stackFree(foundThread->stack, foundThread->memsize);
+				handleFree(&allThreads, thread);
+				delete foundThread;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_SUCCESS;
+			} else {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_STATE;
+			}
+		}
+
+	}
+
+ void fileOpenCallback(void* calldata, int result) {
+ 		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		// put result in file descriptor
+ 		struct fileOpenData *data = (struct fileOpenData *)calldata;
+		*(data->filedescriptor) = result;
+		struct Thread *thread = data->thread;
+		thread->ioPending -= 1;
+		traceRecord(TRACE_IO_COMPLETE, thread->tid, result);
+		callbackWake(thread);
+
+		MachineResumeSignals(&sigstate);	
+	}
+
+	TVMStatus InternalFileOpen(const char *filename, int flags, int mode, int *filedescriptor) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		if (filename && filedescriptor) {
+			*filedescriptor = NOT_SET;
+			struct fileOpenData fileData;	// blocked until the callback is done with it, so the stack is fine
+			fileData.thread = curThread;
+			fileData.filedescriptor = filedescriptor;
+
+			traceRecord(TRACE_IO_SUBMIT, curThread->tid, NOT_SET);
+			curThread->ioPending += 1;
+			MachineFileOpen(filename, flags, mode, &fileOpenCallback, &fileData);
+			makeWaiting(curThread);
+			scheduler();
+
+			if (*filedescriptor < 0) {
+				MachineResumeSignals(&sigstate);	
+				return VM_STATUS_FAILURE;
+			} else {
+				MachineResumeSignals(&sigstate);	
+				return VM_STATUS_SUCCESS;
+			}
+		} else {
+			MachineResumeSignals(&sigstate);	
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void fileCloseCallback(void* calldata, int result) {
+ 		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+ 		struct fileCloseData *data = (struct fileCloseData *)calldata;
+		*(data->result) = result;
+		struct Thread *thread = data->thread;
+
+		thread->ioPending -= 1;
+		traceRecord(TRACE_IO_COMPLETE, thread->tid, result);
+		callbackWake(thread);
+
+		MachineResumeSignals(&sigstate);	
+	}	
+
+	TVMStatus InternalFileClose(int filedescriptor) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		int result = 10; // hasn't been closed 
+		struct fileCloseData fileData;	// blocked until the callback is done with it, so the stack is fine
+		fileData.thread = curThread;
+		fileData.result = &result;
+
+
+		traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+		curThread->ioPending += 1;
+		MachineFileClose(filedescriptor, &fileCloseCallback, &fileData);
+		makeWaiting(curThread);
+		scheduler();
+
+		while(result == 10) {	// wait until fileDescriptor has been set
+		}
+
+		if (result < 0) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;
+		} else {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_SUCCESS;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void fileWriteCallback(void* calldata, int result) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+ 		struct fileWriteData *data = (struct fileWriteData *)calldata;
+		*(data->numBytes) = result;
+
+		struct Thread *thread = data->thread;
+		*(data->numCallbacksDone) += 1;
+
+		thread->ioPending -= 1;
+		traceRecord(TRACE_IO_COMPLETE, thread->tid, result);
+		if (*(data->numCallbacksDone) == data->numCallbacksNeeded) {	// last section of the batch is back
+			callbackWake(thread);
+		}
+
+		MachineResumeSignals(&sigstate);	
+	}
+
+	TVMStatus VMFileWrite(int filedescriptor, void *data, int *length) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		
+		if(filedescriptor < 3) {
+			InternalFileWrite(filedescriptor, data, length);
+		} else {
+			if((unsigned int)filedescriptor < openFiles.size() && openFiles[filedescriptor]) {
+				struct FileEntry* curFile = openFiles[filedescriptor];
+				//std::cout << "finds file is open" << std::endl;
+				//std::cout << "flags " << curFile->flags << std::endl;
+				if ((curFile->flags & O_ACCMODE) > 0) {
+					if (curFile->buffered) {
+						// the buffer ends where the cluster being written ends, so a full one goes out without reading the cluster first
+						int clusterBytes = bpb->SecPerClus * 512;
+						int capacity = clusterBytes - (curFile->curOffset % clusterBytes);
+						if (curFile->bufferedBytes + *length > capacity) {
+							if (!fileFlush(curFile)) {
+								MachineResumeSignals(&sigstate);
+								return VM_STATUS_FAILURE;
+							}
+							capacity = clusterBytes - (curFile->curOffset % clusterBytes);
+						}
+
+						if (*length < capacity) {
+							memcpy(&(curFile->writeBuffer[curFile->bufferedBytes]), data, *length);
+							curFile->bufferedBytes += *length;
+							if (curFile->bufferedBytes == capacity && !fileFlush(curFile)) {
+								MachineResumeSignals(&sigstate);
+								return VM_STATUS_FAILURE;
+							}
+							MachineResumeSignals(&sigstate);
+							return VM_STATUS_SUCCESS;
+						}
+					}
+
+					// too big to be worth buffering, or not buffered
+					int bytesWritten = fileWrite(curFile, (uint8_t*)data, *length);
+					if (bytesWritten > 0) {
+						fileMetadataWrite(curFile);
+					}
+
+					//std::cout << "offset in file" << curFile->curOffset << std::endl;
+					//std::cout << "Entry Num" << curFile->rootEntry->entryNum << std::endl;
+
+					if (bytesWritten == 0 && *length > 0) {
+						MachineResumeSignals(&sigstate);
+						return VM_STATUS_FAILURE;
+					}
+					*length = bytesWritten;
+
+				} else {
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_FAILURE;
+				}
+
+			} else {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
+			}
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void fileReadCallback(void* calldata, int result) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-				fatInformation->FirstRootSector = bpb->ResvdSecCount + (bpb->NumFATs * bpb->FATSz16);
-				fatInformation->RootDirectorySectors = (bpb->RootEntCnt * 32) / 512;
-				fatInformation->FirstDataSector = fatInformation->FirstRootSector + fatInformation->RootDirectorySectors;
-				fatInformation->ClusterCount = (bpb->TotSec32 - fatInformation->FirstDataSector) / bpb->SecPerClus;
+ 		struct fileReadData *data = (struct fileReadData *)calldata;
+		*(data->numBytes) = result;
+		struct Thread *thread = data->thread;
 
-				//displayBPB(bpb);
-				//displayFatInfo(fatInformation);
+		*(data->numCallbacksDone) += 1;
 
-				//read in FAT (will be number of sectors in Fat = BPB_FatSz16, copy into FAT)
-				int numEntries = bpb->FATSz16 * 256; // had originally * 256
-				//uint16_t fatTable[numEntries];
-				fatTable.resize(numEntries);
+		thread->ioPending -= 1;
+		traceRecord(TRACE_IO_COMPLETE, thread->tid, result);
+		if (*(data->numCallbacksDone) == data->numCallbacksNeeded) {	// last section of the batch is back
+			callbackWake(thread);
+		}
 
-				for(int i = 0; i < bpb->FATSz16; i++) {
-					int secNum = 1 + i;
-					uint8_t fatTableSector[512];
-					ReadSector(secNum, fatTableSector);
-					int index = 256 * i;
-					memcpy(&fatTable[index], fatTableSector, 512);
-				}
+		MachineResumeSignals(&sigstate);	
+	}
 
-				// for (int i = 0; i < numEntries; i++) {
-				// 	std::ios  state(NULL);
-				//  	state.copyfmt(std::cout);
-				//  	std::cout << std::hex << fatTable[i] << " " << std::endl;
-				//  	std::cout.copyfmt(state);
-				//  }
+	TVMStatus InternalFileRead(int filedescriptor, void *data, int *length) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		if (data && length) {
+			if (sharedLeased(data, *length)) {
+				// leased buffer is already shared memory, the machine reads straight into it
+				int callbacksReturned = 0;
+				struct fileReadData fileData;
+				fileData.thread = curThread;
+				fileData.numBytes = length;
+				fileData.sectionIndex = 0;
+				fileData.numCallbacksDone = &callbacksReturned;
+				fileData.numCallbacksNeeded = 1;
+				traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+				curThread->ioPending += 1;
+				MachineFileRead(filedescriptor, data, *length, &fileReadCallback, &fileData);
+				makeWaiting(curThread);
+				scheduler();
 
-				// read in root directory, for each file (32 bytes), read in info, then store in rootDirectories
-				int rootSize = fatInformation->RootDirectorySectors * 512;
-				rootData.resize(rootSize);
-				for(unsigned int i = 0; i < fatInformation->RootDirectorySectors; i++) {
-					int secNum = fatInformation->FirstRootSector + i;
-					uint8_t rootSector[512];
-					ReadSector(secNum, rootSector);
-					int index = 512 * i;
-					memcpy(&rootData[index], rootSector, 512);
+				MachineResumeSignals(&sigstate);
+				return (*length < 0) ? VM_STATUS_FAILURE : VM_STATUS_SUCCESS;
+			}
+
+			int bytesRead = 0;
+			int bytesLeft = *length;
+			bool failed = false;
+			bool endOfFile = false;
+
+			unsigned char *fileStart = (unsigned char*)data;
+
+			while (bytesLeft > 0 && !failed && !endOfFile) {
+				// one block as big as what is left when the buddy allocator has it, more smaller blocks when it doesn't
+				unsigned char *blocks[maxIOInFlight];
+				int bytesUsed[maxIOInFlight];
+				int numSectionsNeeded = 0;
+				while (numSectionsNeeded < maxIOInFlight && bytesLeft > 0) {
+					TVMMemorySize blockSize;
+					blocks[numSectionsNeeded] = (unsigned char*)sharedAlloc(bytesLeft, &blockSize);
+					if (!blocks[numSectionsNeeded]) {
+						break;
+					}
+					bytesUsed[numSectionsNeeded] = (bytesLeft < (int)blockSize) ? bytesLeft : blockSize;
+					bytesLeft -= bytesUsed[numSectionsNeeded];
+					numSectionsNeeded += 1;
 				}
-				// read in info, store in rootDirectories
-				for(int i = 0; i < rootSize; i += 32) {
-					if (rootData[i] != 0x00) { //see if empty file !!!!! MAY NOT BE CORRECT MAY NEED TO BE MORE SPECIFIC!!!!!!
-						//read into a Directory struct
-						//check if LongEntry
 
-						struct DirectoryEntry* fullEntry = new struct DirectoryEntry;
-						SVMDirectoryEntryRef newEntry = new SVMDirectoryEntry;
-						memcpy(&(newEntry->DAttributes), &rootData[i+11], 1);
+				if (numSectionsNeeded == 0) {
+					curThread->memoryWanted = memSectionSize;	// any block will do, the transfer gets split
+					queuePush(&waitingOnMemory, &(curThread->schedLink));
+					setState(curThread, VM_THREAD_STATE_WAITING);
+					scheduler();
+					continue;
+				}
 
-						if ((newEntry->DAttributes & VM_FILE_SYSTEM_ATTR_LONG_NAME_MASK) == VM_FILE_SYSTEM_ATTR_LONG_NAME) {
-							continue;
-						} else {
-							// need to put in bytes here... with bitwise operators
-							// bitFunction(&(newEntry->DCreate), 2 bytes)
-							// bitFunction(DVMDateREf, bytes)
-							fullEntry->entryNum = (int)(i / 32);
-							memcpy(&(newEntry->DShortFileName), &rootData[i], 11);
-							// Not passing right thing
-							uint16_t* dateCrtData = (uint16_t*)&(rootData[i+16]);
-							uint16_t* timeCrtData = (uint16_t*)&(rootData[i+14]);
-							setDateStruct(&(newEntry->DCreate), *dateCrtData, *timeCrtData);
+				// every block goes in flight at once, only the last completion wakes the thread
+				int callbacksReturned = 0;
+				int results[maxIOInFlight];
+				struct fileReadData fileData[maxIOInFlight];	// lives until every callback is back
 
-							uint16_t* dateModData = (uint16_t*)&(rootData[i+24]);
-							uint16_t* timeModData = (uint16_t*)&(rootData[i+22]);
-							setDateStruct(&(newEntry->DModify), *dateModData, *timeModData);
+				for (int i = 0; i < numSectionsNeeded; i++) {
 
-							uint16_t* dateAccData = (uint16_t*)&(rootData[i+18]);
-							setDateAccess(&(newEntry->DAccess), *dateAccData);
-							//FstClusLO
-							memcpy(&(newEntry->DSize), &rootData[i+28], 4);
-							fullEntry->entry = newEntry;
-							memcpy(&(fullEntry->FstClusLO), &rootData[i+26], 2);
-							//add to list of directories
-							rootDirectories.push_back(fullEntry);
+					fileData[i].thread = curThread;
+					fileData[i].numBytes = &(results[i]);
+					fileData[i].sectionIndex = i;
+					fileData[i].numCallbacksDone = &callbacksReturned;
+					fileData[i].numCallbacksNeeded = numSectionsNeeded;
+
+					// requests on one descriptor are done in order, so block i reads the i-th chunk
+					traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+					curThread->ioPending += 1;
+					MachineFileRead(filedescriptor, blocks[i], bytesUsed[i], &fileReadCallback, &(fileData[i]));
+				}
+
+				makeWaiting(curThread);
+				scheduler();
+
+				for (int i = 0; i < numSectionsNeeded; i++) {
+					if (results[i] < 0) {
+						failed = true;
+					} else if (!failed && !endOfFile) {
+						memcpy(fileStart, blocks[i], results[i]);
+						fileStart = fileStart + results[i];
+						bytesRead += results[i];
+						if (results[i] < bytesUsed[i]) {
+							endOfFile = true;	// short read, anything after it came back empty
 						}
+					}
+
+					sharedFree(blocks[i]);
+				}
+			}
+
+			*length = bytesRead;
+			
+			if (failed) {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
+			} else {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_SUCCESS;
+			}
+		} else {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	void fileSeekCallback(void* calldata, int result) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		struct fileSeekData *data = (struct fileSeekData *)calldata;
+		*(data->curOffset) = result;
+		struct Thread *thread = data->thread;
+		thread->ioPending -= 1;
+		traceRecord(TRACE_IO_COMPLETE, thread->tid, result);
+		callbackWake(thread);
+
+		MachineResumeSignals(&sigstate);	
+	}	
+
+	TVMStatus InternalFileSeek(int filedescriptor, int offset, int whence, int *newoffset) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		int result = 0;
+
+		struct fileSeekData fileData;	// blocked until the callback is done with it, so the stack is fine
+		fileData.thread = curThread;
+		if (newoffset) {
+			fileData.curOffset = newoffset;
+		} else {
+			fileData.curOffset = &result;
+		}
+		
+		traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+		curThread->ioPending += 1;
+		MachineFileSeek(filedescriptor, offset, whence, &fileSeekCallback, &fileData);
+
+		makeWaiting(curThread);
+		scheduler();
+
+		if (result < 0) {
+			MachineResumeSignals(&sigstate);	
+			return VM_STATUS_FAILURE;
+		} else {
+			MachineResumeSignals(&sigstate);	
+			return VM_STATUS_SUCCESS;
+		}
+		MachineResumeSignals(&sigstate);	
+		return VM_STATUS_SUCCESS;
+	}
+
+	struct IORequest *ioRequestAlloc(int type) {
+		if (ioFreeHead < 0) {
+			return NULL;	// pool is used up
+		}
+
+		struct IORequest *request = &(ioRequests[ioFreeHead]);
+		request->id = handleAlloc(&allIORequests, request);
+		if (request->id == VM_THREAD_ID_INVALID) {
+			return NULL;
+		}
+		ioFreeHead = request->nextFree;
+
+		request->type = type;
+		request->done = false;
+		request->result = 0;
+		request->waiter = VM_THREAD_ID_INVALID;
+		request->data = NULL;
+		request->block = NULL;
+		return request;
+	}
+
+	void ioRequestFree(struct IORequest *request) {
+		handleFree(&allIORequests, request->id);
+		request->nextFree = ioFreeHead;
+		ioFreeHead = request - ioRequests;
+	}
+
+	void ioRequestCallback(void *calldata, int result) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		struct IORequest *request = (struct IORequest *)calldata;
+		request->result = result;
+		request->done = true;
+
+		// finish the bounce for a read, then the block can go back
+		if (request->block) {
+			if (request->type == IO_READ && result > 0) {
+				memcpy(request->data, request->block, result);
+			}
+			sharedFree(request->block);
+			request->block = NULL;
+		}
+
+		struct Thread *thread = (struct Thread*)handleLookup(&allThreads, request->waiter);
+		traceRecord(TRACE_IO_COMPLETE, thread ? thread->tid : VM_THREAD_ID_INVALID, result);
+		bool woke = false;
+		if (thread && thread->state == VM_THREAD_STATE_WAITING) {	// not if its VMIOWait already timed out
+			removeFromWaiting(thread);
+			timerCancel(thread);	// a timed VMIOWait, it's woken by the completion now
+			makeReady(thread);
+			woke = true;
+		}
+		// the freed block may be what a thread stuck on shared memory needs, which in tickless idle would otherwise
+		// wait for the next alarm
+		struct Thread *memoryWaiter = memoryWaiterFit();
+		if (memoryWaiter) {
+			makeReady(memoryWaiter);
+			woke = true;
+		}
+		// both are made ready first, switching away from idle for one would hold up the other until idle runs again
+		if (woke && curThread->priority == VM_THREAD_PRIORITY_IDLE) {
+			ticklessExit(false);
+			scheduler();
+		}
+
+		MachineResumeSignals(&sigstate);
+	}
+
+	TVMStatus ioSubmit(int type, int filedescriptor, void *data, int length, int whence, struct IORequest **requestref) {
+		// signals are already suspended, for a seek length is the offset
+		struct IORequest *request = ioRequestAlloc(type);
+		if (!request) {
+			return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+		}
+
+		// the FAT code never hands the caller's buffer to the Machine, a read goes straight into it and a write is copied
+		// so the caller can reuse its buffer, neither holds shared memory the fileIO thread's own transfers may need
+		if (filedescriptor >= 3 && type == IO_WRITE) {
+			request->copy.assign((uint8_t*)data, (uint8_t*)data + length);
+		} else if (filedescriptor < 3 && type != IO_SEEK && !sharedLeased(data, length)) {
+			// bounce through one shared block, waiting for one if there isn't a big enough one free
+			TVMMemorySize blockSize = memSectionSize;
+			while ((int)blockSize < length && blockSize <= sharedLargestBlock) {
+				blockSize <<= 1;
+			}
+			if (blockSize > sharedLargestBlock) {
+				ioRequestFree(request);
+				return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;	// bigger than any block the region has
+			}
+			while (sharedLargestFree() < blockSize) {
+				curThread->memoryWanted = blockSize;
+				queuePush(&waitingOnMemory, &(curThread->schedLink));
+				setState(curThread, VM_THREAD_STATE_WAITING);
+				scheduler();
+			}
+			request->block = (unsigned char*)sharedAlloc(length, &blockSize);
+			request->data = data;
+			if (type == IO_WRITE) {
+				memcpy(request->block, data, length);	// caller can reuse its buffer as soon as this returns
+			}
+		}
+
+		traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+		if (filedescriptor >= 3) {
+			// descriptors in the mounted image are served by the FAT code on the fileIO thread
+			request->filedescriptor = filedescriptor;
+			request->data = data;
+			request->length = length;
+			request->whence = whence;
+			*requestref = request;
+			fileIOSubmit(request);
+			return VM_STATUS_SUCCESS;
+		}
+		if (type == IO_READ) {
+			MachineFileRead(filedescriptor, request->block ? request->block : data, length, &ioRequestCallback, request);
+		} else if (type == IO_WRITE) {
+			MachineFileWrite(filedescriptor, request->block ? request->block : data, length, &ioRequestCallback, request);
+		} else {
+			MachineFileSeek(filedescriptor, length, whence, &ioRequestCallback, request);
+		}
+		*requestref = request;
+		return VM_STATUS_SUCCESS;
+	}
+
+	void ioRequestWait(struct IORequest *request) {
+		while (!request->done) {
+			request->waiter = curThread->tid;
+			makeWaiting(curThread);
+			scheduler();
+			request->waiter = VM_THREAD_ID_INVALID;
+		}
+	}
+
+	// signals are already suspended
+	void fileIOSubmit(struct IORequest *request) {
+		fileIOQueue.push_back(request);
+		if (fileIOWaiting.size != 0) {
+			struct Thread *waiter = queuePop(&fileIOWaiting);
+			waitWake(waiter);
+			if (waiter->priority > curThread->priority) {	// run it now instead of at the next tick
+				scheduler();
+			}
+		}
+	}
+
+	// runs requests on image descriptors one at a time in submit order, completing each like a Machine callback would
+	void fileIOWorker(void *param) {
+		while (true) {
+			TMachineSignalState sigstate;
+			MachineSuspendSignals(&sigstate);
+			if (fileIOQueue.empty()) {
+				fileIOBusy = false;
+				while (fileIODrained.size != 0) {
+					waitWake(queuePop(&fileIODrained));
+				}
+				waitBlock(&fileIOWaiting, VM_TIMEOUT_INFINITE);
+				MachineResumeSignals(&sigstate);
+				continue;
+			}
+			struct IORequest *request = fileIOQueue.front();
+			fileIOQueue.pop_front();
+			fileIOBusy = true;
+			MachineResumeSignals(&sigstate);
+
+			int result = request->length;
+			TVMStatus status;
+			if (request->type == IO_READ) {
+				status = VMFileRead(request->filedescriptor, request->data, &result);
+			} else if (request->type == IO_WRITE) {
+				status = VMFileWrite(request->filedescriptor, request->copy.empty() ? request->data : &(request->copy[0]), &result);
+			} else if (request->type == IO_SEEK) {
+				status = VMFileSeek(request->filedescriptor, request->length, request->whence, &result);
+			} else {
+				status = VMFileOpen(request->filename, request->flags, request->mode, &result);	// result is the new descriptor
+			}
+			if (status != VM_STATUS_SUCCESS) {
+				result = -1;
+			}
+			ioRequestCallback(request, result);	// wakes the waiter
+		}
+	}
+
+	TVMStatus VMFileReadAsync(int filedescriptor, void *data, int length, TVMIORequestIDRef requestref) {
+		TMachineSignalState sigstate;
+		if (!data || !requestref || length < 0) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		MachineSuspendSignals(&sigstate);
+		struct IORequest *request;
+		TVMStatus status = ioSubmit(IO_READ, filedescriptor, data, length, 0, &request);
+		if (status == VM_STATUS_SUCCESS) {
+			*requestref = request->id;
+		}
+		MachineResumeSignals(&sigstate);
+		return status;
+	}
+
+	TVMStatus VMFileWriteAsync(int filedescriptor, void *data, int length, TVMIORequestIDRef requestref) {
+		TMachineSignalState sigstate;
+		if (!data || !requestref || length < 0) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		MachineSuspendSignals(&sigstate);
+		struct IORequest *request;
+		TVMStatus status = ioSubmit(IO_WRITE, filedescriptor, data, length, 0, &request);
+		if (status == VM_STATUS_SUCCESS) {
+			*requestref = request->id;
+		}
+		MachineResumeSignals(&sigstate);
+		return status;
+	}
+
+	TVMStatus VMFileSeekAsync(int filedescriptor, int offset, int whence, TVMIORequestIDRef requestref) {
+		TMachineSignalState sigstate;
+		if (!requestref) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		MachineSuspendSignals(&sigstate);
+		struct IORequest *request;
+		TVMStatus status = ioSubmit(IO_SEEK, filedescriptor, NULL, offset, whence, &request);
+		if (status == VM_STATUS_SUCCESS) {
+			*requestref = request->id;
+		}
+		MachineResumeSignals(&sigstate);
+		return status;
+	}
+
+	// opening can read and write root directory and FAT sectors, so it goes through the fileIO thread too
+	TVMStatus VMFileOpenAsync(const char *filename, int flags, int mode, TVMIORequestIDRef requestref) {
+		TMachineSignalState sigstate;
+		if (!filename || !requestref || strlen(filename) >= VM_FILE_SYSTEM_MAX_PATH) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		MachineSuspendSignals(&sigstate);
+		struct IORequest *request = ioRequestAlloc(IO_OPEN);
+		if (!request) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+		}
+		strcpy(request->filename, filename);
+		request->flags = flags;
+		request->mode = mode;
+		request->data = NULL;
+		*requestref = request->id;
+		traceRecord(TRACE_IO_SUBMIT, curThread->tid, NOT_SET);
+		fileIOSubmit(request);
+
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMBatchSubmit(SVMBatchOpRef ops, unsigned int count, SVMBatchCompletionRef completions) {
+		TMachineSignalState sigstate;
+		if (!ops || !completions) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		// one critical section for the whole batch, file operations go out back to back and are collected together
+		MachineSuspendSignals(&sigstate);
+		struct IORequest *pending[maxIORequests];
+		unsigned int pendingOp[maxIORequests];
+		int numPending = 0;
+
+		for (unsigned int i = 0; i <= count; i++) {
+			bool isFileOp = (i < count && ops[i].DOperation <= VM_BATCH_OP_SEEK);
+
+			// collect outstanding file operations at the end, before a mutex operation, or when the pool runs out
+			if (numPending > 0 && (i == count || !isFileOp || numPending == maxIORequests || ioFreeHead < 0)) {
+				for (int j = 0; j < numPending; j++) {
+					ioRequestWait(pending[j]);
+					completions[pendingOp[j]].DResult = pending[j]->result;
+					completions[pendingOp[j]].DStatus = (pending[j]->result < 0) ? VM_STATUS_FAILURE : VM_STATUS_SUCCESS;
+					ioRequestFree(pending[j]);
+				}
+				numPending = 0;
+			}
+			if (i == count) {
+				break;
+			}
 
-					} else {
-						break;
-					}
+			completions[i].DResult = 0;
+			if (isFileOp) {
+				int type = (ops[i].DOperation == VM_BATCH_OP_READ) ? IO_READ : (ops[i].DOperation == VM_BATCH_OP_WRITE) ? IO_WRITE : IO_SEEK;
+				if (type != IO_SEEK && (!ops[i].DData || ops[i].DLength < 0)) {
+					completions[i].DStatus = VM_STATUS_ERROR_INVALID_PARAMETER;
+					continue;
+				}
+				completions[i].DStatus = ioSubmit(type, ops[i].DDescriptor, ops[i].DData, ops[i].DLength, ops[i].DWhence, &(pending[numPending]));
+				if (completions[i].DStatus == VM_STATUS_SUCCESS) {
+					pendingOp[numPending] = i;
+					numPending += 1;
+				}
+			} else if (ops[i].DOperation == VM_BATCH_OP_MUTEX_ACQUIRE) {
+				// uncontended acquire is done right here, anything that could block goes through VMMutexAcquire
+				struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, ops[i].DDescriptor);
+				if (foundMutex && foundMutex->unlocked && foundMutex->waitingMutex.size == 0) {
+					foundMutex->unlocked = false;
+					foundMutex->owner = curThread->tid;
+					curThread->mutexesOwned.push_back(foundMutex->id);
+					traceRecord(TRACE_MUTEX_ACQUIRE, curThread->tid, foundMutex->id);
+					completions[i].DStatus = VM_STATUS_SUCCESS;
+				} else {
+					completions[i].DStatus = VMMutexAcquire(ops[i].DDescriptor, ops[i].DTimeout);
+				}
+			} else if (ops[i].DOperation == VM_BATCH_OP_MUTEX_RELEASE) {
+				// same for a release nobody is waiting on
+				struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, ops[i].DDescriptor);
+				if (foundMutex && !foundMutex->unlocked && foundMutex->owner == curThread->tid && foundMutex->waitingMutex.size == 0) {
+					mutexRelease(foundMutex, curThread);
+					completions[i].DStatus = VM_STATUS_SUCCESS;
+				} else {
+					completions[i].DStatus = VMMutexRelease(ops[i].DDescriptor);
 				}
+			} else {
+				completions[i].DStatus = VM_STATUS_ERROR_INVALID_PARAMETER;
+			}
+		}
 
-				openFiles.push_back(NULL);	// set openFiles, 0, 1, 2 all to NULL (not applicable)
-				openFiles.push_back(NULL);
-				openFiles.push_back(NULL);
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-				// for (int i =0; i < rootDirectories.size(); i++) {
-				// 	std::cout << "FileName: " << rootDirectories[i]->entry->DShortFileName << std::endl;
-				// 	std::cout << "FileSize: " << rootDirectories[i]->entry->DSize << std::endl;
-				// 	std::cout << "Created Date: " << (int)rootDirectories[i]->entry->DCreate.DMonth << "/" << (int)rootDirectories[i]->entry->DCreate.DDay << "/" << (int)rootDirectories[i]->entry->DCreate.DYear << std::endl;
-				// 	std::cout << "Created Time: " << (int)rootDirectories[i]->entry->DCreate.DHour << ":" << (int)rootDirectories[i]->entry->DCreate.DMinute << ":" << (int)rootDirectories[i]->entry->DCreate.DSecond << std::endl;
-				// 	std::cout << "FstClusLO: " << rootDirectories[i]->FstClusLO << std::endl;
-				// }
+	TVMStatus VMIOWait(TVMIORequestID request, TVMTick timeout, int *resultref) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-				(*entryPoint)(argc, argv);
+		struct IORequest *foundRequest = (struct IORequest*)handleLookup(&allIORequests, request);
+		if (!foundRequest) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else if (foundRequest->waiter != VM_THREAD_ID_INVALID) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;	// another thread is already waiting on it
+		}
 
-				InternalFileClose(fatFileDescriptor);
-				MachineTerminate();
-				VMUnloadModule();
-		} else {
-			return VM_STATUS_FAILURE;
+		if (!foundRequest->done && timeout != VM_TIMEOUT_IMMEDIATE) {
+			foundRequest->waiter = curThread->tid;
+			makeWaiting(curThread);
+			if (timeout != VM_TIMEOUT_INFINITE) {
+				timerAdd(curThread, timeout);
+			}
+			scheduler();
+			timerCancel(curThread);
+			foundRequest->waiter = VM_THREAD_ID_INVALID;
+		}
+
+		if (!foundRequest->done) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;	// still in flight, the request stays valid
+		}
+
+		// completed requests are handed back to the pool once their result is collected
+		if (resultref) {
+			*resultref = foundRequest->result;
 		}
+		ioRequestFree(foundRequest);
 
+		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
+	}
 
-	}	
+	TVMStatus VMIOPoll(TVMIORequestID request, int *resultref) {
+		return VMIOWait(request, VM_TIMEOUT_IMMEDIATE, resultref);
+	}
 
-	TVMStatus VMTickMS(int *tickmsref) {
+	void skeleton (void *data) {
+		MachineEnableSignals();
+
+		curThread->threadEntry(curThread->parameter);
+
+		VMThreadTerminate(curThread->tid);
+	}
+
+	TVMStatus VMMutexCreate(TVMMutexIDRef mutexref) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (tickmsref) {	// location exists
-			*tickmsref = interval;
+
+		if(mutexref){
+			struct Mutex* newMutex = new struct Mutex;
+			newMutex->unlocked = true;
+			queueInit(&(newMutex->waitingMutex));
+			newMutex->id = handleAlloc(&allMutexes, newMutex);
+
+			if (newMutex->id == VM_THREAD_ID_INVALID) {
+				delete newMutex;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;	// no more mutex IDs
+			}
+			*mutexref = newMutex->id;
+
 		} else {
 			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
+			return VM_STATUS_ERROR_INVALID_PARAMETER; // invalid mutex ref
 		}
+
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMTickCount(TVMTickRef tickref) {
+	TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (tickref) {
-			*tickref = curTicks;
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_SUCCESS;
-		} else {
-			MachineResumeSignals(&sigstate);
+		if(ownerref) {
+			struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, mutex);
+			if (!foundMutex) {	// mutex id does not exist
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_ID;
+			} else {
+				if(foundMutex->unlocked == true) {	// thread is unlocked, cannot store owner
+					*ownerref = VM_THREAD_ID_INVALID;
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_SUCCESS;
+				} else {
+					*ownerref = foundMutex->owner;	// store mutex owner in ownerref
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_SUCCESS;
+				}
+			}
+		} else {	// ownerref does not exist
+			MachineResumeSignals(&sigstate);	
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
+
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
+		
 	}
 
-	void alarmCallback(void *calldata) {
+	TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
-		curTicks += 1;	// add tick
-
-		// those waiting on mutex, deduct from their timeout
-		int numLoopsMutex = waitingOnMutex.size();
-		for (int i = 0; i < numLoopsMutex; i++) {
-			struct Thread *waiting = waitingOnMutex.front();
-			waitingOnMutex.pop();
-
-			if (waiting->timeoutDuration > 0) {
-				waiting->timeoutDuration -= 1;
-				// sleep for a tick
-				if (waiting->timeoutDuration == 0) {
-					// reached duration of timeout, make ready to try one last acquire
-					removeFromWaitingOnMutex(waiting);
-					// need to remove from the mutexes waiting list
-					makeReady(waiting);
+		struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, mutex);
+		if (!foundMutex) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+
+			if(timeout == VM_TIMEOUT_IMMEDIATE) {	// immediate, either get or fail to get mutex this moment
+				if(foundMutex->unlocked == false) {
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_FAILURE;
+				} else {
+					if(foundMutex->waitingMutex.size == 0) {
+						foundMutex->unlocked = false;
+						foundMutex->owner = curThread->tid;
+						curThread->mutexesOwned.push_back(mutex);
+						traceRecord(TRACE_MUTEX_ACQUIRE, curThread->tid, mutex);
+						MachineResumeSignals(&sigstate);
+						return VM_STATUS_SUCCESS;
+					} else {
+						MachineResumeSignals(&sigstate);
+						return VM_STATUS_FAILURE;
+					}
+				}
+			} else if (timeout == VM_TIMEOUT_INFINITE) {
+				if(foundMutex->unlocked == false) {
+					queuePush(&(foundMutex->waitingMutex), &(curThread->waitLink));	// add it to waiting, schedule new thread
+					curThread->blockedOn = foundMutex;
+					priorityBoost((struct Thread*)handleLookup(&allThreads, foundMutex->owner), curThread->priority);	// owner runs at least as high as its waiters
+					TVMTick waitStart = curTicks;
+					setState(curThread, VM_THREAD_STATE_WAITING);
+					scheduler();
+					curThread->stats.DTicksMutexWait += curTicks - waitStart;
 				} else {
-					// hasn't been woken, still waiting on mutex
-					waitingOnMutex.push(waiting);
+					foundMutex->unlocked = false;
+					foundMutex->owner = curThread->tid;
+					curThread->mutexesOwned.push_back(mutex);
+					traceRecord(TRACE_MUTEX_ACQUIRE, curThread->tid, mutex);
+					MachineResumeSignals(&sigstate);
+					return VM_STATUS_SUCCESS;
 				}
-
 			} else {
-				// if waiting indefinitely, just push back on
-				waitingOnMutex.push(waiting);
+				if(foundMutex->unlocked == true) {	// is free to be acquired
+						foundMutex->unlocked = false;
+						foundMutex->owner = curThread->tid;
+						curThread->mutexesOwned.push_back(mutex);
+						traceRecord(TRACE_MUTEX_ACQUIRE, curThread->tid, mutex);
+				} else {
+					queuePush(&(foundMutex->waitingMutex), &(curThread->waitLink));	// add it to waiting, schedule new thread
+					curThread->blockedOn = foundMutex;
+					priorityBoost((struct Thread*)handleLookup(&allThreads, foundMutex->owner), curThread->priority);	// owner runs at least as high as its waiters
+					timerAdd(curThread, timeout);
+					TVMTick waitStart = curTicks;
+					setState(curThread, VM_THREAD_STATE_WAITING);
+					scheduler();
+					curThread->stats.DTicksMutexWait += curTicks - waitStart;
+					// when wakes up, either VMMutexRelease handed it the mutex or the timeout ran out
+					if(foundMutex->unlocked == false && foundMutex->owner == curThread->tid) {
+						// already the owner, release cancelled the timer
+					} else if(foundMutex->unlocked == true) {	// is free to be acquired
+						if(foundMutex->waitingMutex.size == 0) {	//no others waiting, can become thread rn
+							foundMutex->unlocked = false;
+							foundMutex->owner = curThread->tid;
+							curThread->mutexesOwned.push_back(mutex);
+							traceRecord(TRACE_MUTEX_ACQUIRE, curThread->tid, mutex);
+						} else {
+							// remove from the waiting of the mutex
+							mutexWaitCancel(curThread);
+
+							MachineResumeSignals(&sigstate);
+							return VM_STATUS_FAILURE;	// was not able to acquire was unlocked but others are waiting (should never happen but could be outlier)
+						} 
+					} else {
+						mutexWaitCancel(curThread);
+
+						MachineResumeSignals(&sigstate);	// mutex was not unlocked
+						return VM_STATUS_FAILURE;
+					}
+				}
 			}
 
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_SUCCESS;
 		}
-		// if timeout gets reached, remove from waiting on mutex queue, check to see if can acquire again
+	}
 
+	TVMStatus VMMutexRelease(TVMMutexID mutex) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-		// deduct 1 to duration for those that are sleeping
-		int numLoops = waitingThreads.size();
-		for (int i = 0; i < numLoops; i++) {
-			struct Thread *asleep = waitingThreads.front();
-			waitingThreads.pop();
+		struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, mutex);	//finds mutex
+		if (!foundMutex) {	//mutex not valid
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+			if (foundMutex->owner != curThread->tid) {	// if curThread is not the owner
 
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_STATE;
+			} else {
+				mutexRelease(foundMutex, curThread);
 
-			if (asleep->sleepDuration > 0) {
-				asleep->sleepDuration -= 1;
-				// sleep for a tick
-				if (asleep->sleepDuration == 0) {
-					// is asleep and has awoken
-					makeReady(asleep);
-				} else {
-					// is asleep but isn't done sleeping
-					waitingThreads.push(asleep);
+				// let anything that now outranks this thread run
+				if ((readyBitmap >> (curThread->priority + 1)) != 0) {
+					scheduler();
 				}
-
-			} else {
-				// if not asleep but is waiting, push back onto waiting list
-				waitingThreads.push(asleep);
 			}
-
 		}
-		
-		scheduler();
 
 		MachineResumeSignals(&sigstate);
-
-	
+		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadSleep(TVMTick tick) {
+	TVMStatus VMMutexDelete(TVMMutexID mutex) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
-		if (tick == VM_TIMEOUT_INFINITE) {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
-		} else if (tick == VM_TIMEOUT_IMMEDIATE) {
-			// yield rest of time to process of next highest priority
+		struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, mutex);
+		if (!foundMutex) {
 			MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
-
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else {
+			if(foundMutex->unlocked == false) {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_ERROR_INVALID_STATE; 
+			} else {
+				handleFree(&allMutexes, foundMutex->id);
+				delete foundMutex;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_SUCCESS;
+			}
 		}
-		else {
-			makeWaiting(curThread);
-			curThread->sleepDuration = tick;
-			scheduler();	// Not sure if need to call here since scheduler is called every tick
-
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_SUCCESS;
-		}	
-		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsize, TVMThreadPriority prio, TVMThreadIDRef tid) {
+	TVMStatus VMConditionCreate(TVMConditionIDRef conditionref) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
-		if(tid && entry) {
-			// make new thread
-			struct Thread *newThread = new struct Thread;
-			newThread->threadEntry = entry;
-			newThread->parameter = param;
-			newThread->memsize = memsize;
-			newThread->priority = prio;
-			newThread->tid = allThreads.size();
-			*tid = newThread->tid;
-			newThread->state = VM_THREAD_STATE_DEAD;
+		if(conditionref) {
+			struct Condition *newCondition = new struct Condition;
+			queueInit(&(newCondition->waiting));
+			newCondition->id = handleAlloc(&allConditions, newCondition);
 
-			if (allThreads.find(*tid) == allThreads.end()) {
-				allThreads[*tid] = newThread;	// add to all threads if not found already
-			} else {
+			if (newCondition->id == VM_THREAD_ID_INVALID) {
+				delete newCondition;
 				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_PARAMETER;	// ID has already been used
+				return VM_STATUS_FAILURE;	// no more condition IDs
 			}
-
+			*conditionref = newCondition->id;
 		} else {
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
+
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadState(TVMThreadID thread, TVMThreadStateRef stateref) {
+	TVMStatus VMConditionDelete(TVMConditionID condition) {
 		TMachineSignalState sigstate;
-		if (stateref) {	
-			MachineSuspendSignals(&sigstate);		// suspend and resume here to limit scope
-			if (allThreads.find(thread) == allThreads.end()) {
-				MachineResumeSignals(&sigstate);	//stateref is valid but thread does not exist
-				return VM_STATUS_ERROR_INVALID_ID;
-			} else {
-				struct Thread *foundThread = allThreads.at(thread);
-				*stateref = foundThread->state;		//stateref is valid and thread exists
-			}
+		MachineSuspendSignals(&sigstate);
+
+		struct Condition *foundCondition = (struct Condition*)handleLookup(&allConditions, condition);
+		if (!foundCondition) {
 			MachineResumeSignals(&sigstate);
-		} else {
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else if (foundCondition->waiting.size != 0) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;	// threads are still waiting on it
 		}
+
+		handleFree(&allConditions, condition);
+		delete foundCondition;
+		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadActivate(TVMThreadID thread) {
+	TVMStatus VMConditionWait(TVMConditionID condition, TVMMutexID mutex, TVMTick timeout) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (allThreads.find(thread) == allThreads.end()) {
+
+		struct Condition *foundCondition = (struct Condition*)handleLookup(&allConditions, condition);
+		struct Mutex *foundMutex = (struct Mutex*)handleLookup(&allMutexes, mutex);
+		if (!foundCondition || !foundMutex) {
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_ID;
-		} else {
-			struct Thread *foundThread = allThreads.at(thread);
-			if (foundThread->state == VM_THREAD_STATE_DEAD) {
-				// put into ready state change curThread state to READY
-				makeReady(foundThread);
+		} else if (foundMutex->unlocked || foundMutex->owner != curThread->tid) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;	// has to hold the mutex to wait
+		} else if (timeout == VM_TIMEOUT_IMMEDIATE) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;	// nothing can signal it in zero time
+		}
 
-				// activate thread (create machine context)
-				if (foundThread->memsize  == 0) {
-					foundThread->stack = NULL;
-				} else {
-					foundThread->stack = malloc(foundThread->memsize);
-				}
+		// release and start waiting in the same critical section so a signal can't slip in between
+		mutexRelease(foundMutex, curThread);
+		waitBlock(&(foundCondition->waiting), timeout);
+		TVMStatus status = curThread->waitStatus;
 
-				MachineContextCreate(&(foundThread->context), &skeleton, foundThread->parameter, foundThread->stack, foundThread->memsize);
-				if(foundThread->priority > curThread->priority) {
-					scheduler();
-				}
+		// always comes back holding the mutex, even on timeout
+		VMMutexAcquire(mutex, VM_TIMEOUT_INFINITE);
+
+		MachineResumeSignals(&sigstate);
+		return status;
+	}
+
+	TVMStatus VMConditionSignal(TVMConditionID condition) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+
+		struct Condition *foundCondition = (struct Condition*)handleLookup(&allConditions, condition);
+		if (!foundCondition) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
+
+		if (foundCondition->waiting.size != 0) {
+			struct Thread *waiter = queuePopHighest(&(foundCondition->waiting));
+			waitWake(waiter);
+			if (waiter->priority > curThread->priority) {	// run it now instead of at the next tick
+				scheduler();
+			}
+		}
+
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMConditionBroadcast(TVMConditionID condition) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-			} else {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_STATE;
+		struct Condition *foundCondition = (struct Condition*)handleLookup(&allConditions, condition);
+		if (!foundCondition) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
+
+		bool preempt = false;
+		while (foundCondition->waiting.size != 0) {
+			struct Thread *waiter = queuePop(&(foundCondition->waiting));
+			waitWake(waiter);
+			if (waiter->priority > curThread->priority) {
+				preempt = true;
 			}
 		}
+		if (preempt) {
+			scheduler();
+		}
+
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadID(TVMThreadIDRef threadref) {
+	TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count) {
 		TMachineSignalState sigstate;
-		if (threadref) {
-			MachineSuspendSignals(&sigstate);	// limit scope that needs to suspend
-			*threadref = curThread->tid;
-			MachineResumeSignals(&sigstate);
+		MachineSuspendSignals(&sigstate);
+
+		if(semaphoreref) {
+			struct Semaphore *newSemaphore = new struct Semaphore;
+			newSemaphore->count = count;
+			queueInit(&(newSemaphore->waiting));
+			newSemaphore->id = handleAlloc(&allSemaphores, newSemaphore);
+
+			if (newSemaphore->id == VM_THREAD_ID_INVALID) {
+				delete newSemaphore;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;	// no more semaphore IDs
+			}
+			*semaphoreref = newSemaphore->id;
 		} else {
+			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
+
+		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMThreadTerminate(TVMThreadID thread) {
+	TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (allThreads.find(thread) == allThreads.end()) {
+
+		struct Semaphore *foundSemaphore = (struct Semaphore*)handleLookup(&allSemaphores, semaphore);
+		if (!foundSemaphore) {
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_ID;
-		} else {
-				struct Thread *foundThread = allThreads.at(thread);
-				if (foundThread->state == VM_THREAD_STATE_DEAD) { //if thread is already dead
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_ERROR_INVALID_STATE;
-				} else {
-					if (foundThread->state == VM_THREAD_STATE_READY) {
-						removeFromReady(foundThread);
-					} else if (foundThread->state == VM_THREAD_STATE_WAITING) {
-						removeFromWaiting(foundThread);
-					}
-
-					foundThread->state = VM_THREAD_STATE_DEAD;	// change state to dead, may not be applicable for IDLE
+		} else if (foundSemaphore->waiting.size != 0) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;	// threads are still waiting on it
+		}
 
-					// release any mutexes that are owned
-					if(!foundThread->mutexesOwned.empty()) {
-						int numLoops = foundThread->mutexesOwned.size();
-						for (int i = 0; i < numLoops; i++) {
-							//remove from owned list
-							TVMMutexID ownedMutex = foundThread->mutexesOwned.front();
-							foundThread->mutexesOwned.pop();
+		handleFree(&allSemaphores, semaphore);
+		delete foundSemaphore;
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
+	TVMStatus VMSemaphoreAcquire(TVMSemaphoreID semaphore, TVMTick timeout) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-							struct Mutex *foundMutex = allMutexes.at(ownedMutex);
+		struct Semaphore *foundSemaphore = (struct Semaphore*)handleLookup(&allSemaphores, semaphore);
+		if (!foundSemaphore) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
 
-							//RELEASE
-							if (foundMutex->waitingMutex.empty()) {
-								foundMutex->owner = -1; // no owner, need placeholder
-								foundMutex->unlocked = true;
+		if (foundSemaphore->count > 0) {
+			foundSemaphore->count -= 1;
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_SUCCESS;
+		} else if (timeout == VM_TIMEOUT_IMMEDIATE) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;
+		}
 
-							} else {
-								struct Thread* nextOwner = foundMutex->waitingMutex.front();	// once released, get next owner
-								foundMutex->waitingMutex.pop();
-								removeFromWaitingOnMutex(nextOwner);
-								nextOwner->mutexesOwned.push(foundMutex->id);
-								foundMutex->owner = nextOwner->tid;
-								makeReady(nextOwner);
-							}
-						}
-					}
+		// release hands the count straight to this thread instead of bumping count, so nothing can steal it
+		waitBlock(&(foundSemaphore->waiting), timeout);
+		TVMStatus status = curThread->waitStatus;
 
-					if (foundThread->tid == curThread->tid) { // if thread that is being terminated is current thread
-						scheduler();	// schedule new thread
-					}
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_SUCCESS;
-				}	
-			}	
+		MachineResumeSignals(&sigstate);
+		return status;
 	}
 
-	TVMStatus VMThreadDelete(TVMThreadID thread) {
+	TVMStatus VMSemaphoreRelease(TVMSemaphoreID semaphore) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
-		if (allThreads.find(thread) == allThreads.end()) {
+		struct Semaphore *foundSemaphore = (struct Semaphore*)handleLookup(&allSemaphores, semaphore);
+		if (!foundSemaphore) {
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_ID;
+		}
+
+		if (foundSemaphore->waiting.size == 0) {
+			foundSemaphore->count += 1;
 		} else {
-			struct Thread *foundThread = allThreads.at(thread);
-			if (foundThread->state == VM_THREAD_STATE_DEAD) {
-				free(foundThread->stack);
-				allThreads.erase(thread);
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_SUCCESS;
-			} else {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_STATE;
+			struct Thread *waiter = queuePopHighest(&(foundSemaphore->waiting));
+			waitWake(waiter);
+			if (waiter->priority > curThread->priority) {	// run it now instead of at the next tick
+				scheduler();
 			}
 		}
 
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
 	}
 
- void fileOpenCallback(void* calldata, int result) {
- 		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
-
-		// put result in file descriptor
- 		struct fileOpenData *data = (struct fileOpenData *)calldata;
-		*(data->filedescriptor) = result;
-		struct Thread *thread = data->thread;
-		removeFromWaiting(thread);
-		makeReady(thread);
-
-		MachineResumeSignals(&sigstate);	
+	void rwlockWakeReaders(struct RWLock *rwlock) {
+		// every waiting reader gets in together
+		while (rwlock->waitingReaders.size != 0) {
+			struct Thread *reader = queuePop(&(rwlock->waitingReaders));
+			rwlock->readers += 1;
+			waitWake(reader);
+		}
 	}
 
-	TVMStatus InternalFileOpen(const char *filename, int flags, int mode, int *filedescriptor) {
+	TVMStatus VMRWLockCreate(TVMRWLockIDRef rwlockref) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (filename && filedescriptor) {
-			*filedescriptor = NOT_SET;
-			struct fileOpenData *fileData = new struct fileOpenData;
-			fileData->thread = curThread;
-			fileData->filedescriptor = filedescriptor;
 
-			MachineFileOpen(filename, flags, mode, &fileOpenCallback, fileData);
-			makeWaiting(curThread);
-			curThread->sleepDuration = -1;
-			scheduler();
+		if(rwlockref) {
+			struct RWLock *newRWLock = new struct RWLock;
+			newRWLock->readers = 0;
+			newRWLock->writer = VM_THREAD_ID_INVALID;
+			queueInit(&(newRWLock->waitingReaders));
+			queueInit(&(newRWLock->waitingWriters));
+			newRWLock->id = handleAlloc(&allRWLocks, newRWLock);
 
-			delete fileData;
-
-			if (*filedescriptor < 0) {
-				MachineResumeSignals(&sigstate);	
-				return VM_STATUS_FAILURE;
-			} else {
-				MachineResumeSignals(&sigstate);	
-				return VM_STATUS_SUCCESS;
+			if (newRWLock->id == VM_THREAD_ID_INVALID) {
+				delete newRWLock;
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;	// no more rwlock IDs
 			}
+			*rwlockref = newRWLock->id;
 		} else {
-			MachineResumeSignals(&sigstate);	
+			MachineResumeSignals(&sigstate);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
+
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	void fileCloseCallback(void* calldata, int result) {
- 		TMachineSignalState sigstate;
+	TVMStatus VMRWLockDelete(TVMRWLockID rwlock) {
+		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
- 		struct fileCloseData *data = (struct fileCloseData *)calldata;
-		*(data->result) = result;
-		struct Thread *thread = data->thread;
-
-		removeFromWaiting(thread);
-		makeReady(thread);
+		struct RWLock *foundRWLock = (struct RWLock*)handleLookup(&allRWLocks, rwlock);
+		if (!foundRWLock) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		} else if (foundRWLock->readers != 0 || foundRWLock->writer != VM_THREAD_ID_INVALID) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;	// still held, so waiters can't be empty either
+		}
 
-		MachineResumeSignals(&sigstate);	
-	}	
+		handleFree(&allRWLocks, rwlock);
+		delete foundRWLock;
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-	TVMStatus InternalFileClose(int filedescriptor) {
+	TVMStatus VMRWLockAcquireRead(TVMRWLockID rwlock, TVMTick timeout) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
-		int result = 10; // hasn't been closed 
-		struct fileCloseData *fileData = new struct fileCloseData;
-		fileData->thread = curThread;
-		fileData->result = &result;
+		struct RWLock *foundRWLock = (struct RWLock*)handleLookup(&allRWLocks, rwlock);
+		if (!foundRWLock) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
 
+		// writer preference, a waiting writer keeps new readers out so writers can't starve
+		if (foundRWLock->writer == VM_THREAD_ID_INVALID && foundRWLock->waitingWriters.size == 0) {
+			foundRWLock->readers += 1;
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_SUCCESS;
+		} else if (timeout == VM_TIMEOUT_IMMEDIATE) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;
+		}
 
-		MachineFileClose(filedescriptor, &fileCloseCallback, fileData);
-		makeWaiting(curThread);
-		curThread->sleepDuration = -1;
-		scheduler();
+		// whoever wakes it has already counted it as a reader
+		waitBlock(&(foundRWLock->waitingReaders), timeout);
+		TVMStatus status = curThread->waitStatus;
 
-		while(result == 10) {	// wait until fileDescriptor has been set
-		}
+		MachineResumeSignals(&sigstate);
+		return status;
+	}
 
-		delete fileData;
+	TVMStatus VMRWLockAcquireWrite(TVMRWLockID rwlock, TVMTick timeout) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
 
-		if (result < 0) {
+		struct RWLock *foundRWLock = (struct RWLock*)handleLookup(&allRWLocks, rwlock);
+		if (!foundRWLock) {
 			MachineResumeSignals(&sigstate);
-			return VM_STATUS_FAILURE;
-		} else {
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
+
+		if (foundRWLock->writer == VM_THREAD_ID_INVALID && foundRWLock->readers == 0) {
+			foundRWLock->writer = curThread->tid;
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_SUCCESS;
+		} else if (timeout == VM_TIMEOUT_IMMEDIATE) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;
+		}
+
+		// whoever wakes it has already made it the writer
+		waitBlock(&(foundRWLock->waitingWriters), timeout);
+		TVMStatus status = curThread->waitStatus;
+
+		// timed out, readers only held back for this writer can go now
+		if (status != VM_STATUS_SUCCESS && foundRWLock->writer == VM_THREAD_ID_INVALID && foundRWLock->waitingWriters.size == 0) {
+			rwlockWakeReaders(foundRWLock);
 		}
+
 		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
+		return status;
 	}
 
-	void fileWriteCallback(void* calldata, int result) {
+	TVMStatus VMRWLockRelease(TVMRWLockID rwlock) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
 
- 		struct fileWriteData *data = (struct fileWriteData *)calldata;
-		*(data->numBytes) = result;
+		struct RWLock *foundRWLock = (struct RWLock*)handleLookup(&allRWLocks, rwlock);
+		if (!foundRWLock) {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
 
-		struct Thread *thread = data->thread;
-		*(data->numCallbacksDone) += 1;
+		// readers aren't tracked by ID, anyone but the writer releases a shared hold
+		if (foundRWLock->writer == curThread->tid) {
+			foundRWLock->writer = VM_THREAD_ID_INVALID;
+		} else if (foundRWLock->readers != 0 && foundRWLock->writer == VM_THREAD_ID_INVALID) {
+			foundRWLock->readers -= 1;
+		} else {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_STATE;
+		}
 
-		removeFromWaiting(thread);
-		makeReady(thread);
+		if (foundRWLock->readers == 0) {
+			if (foundRWLock->waitingWriters.size != 0) {
+				struct Thread *writer = queuePopHighest(&(foundRWLock->waitingWriters));
+				foundRWLock->writer = writer->tid;
+				waitWake(writer);
+			} else {
+				rwlockWakeReaders(foundRWLock);
+			}
+		}
 
-		MachineResumeSignals(&sigstate);	
+		// let anything that now outranks this thread run
+		if ((readyBitmap >> (curThread->priority + 1)) != 0) {
+			scheduler();
+		}
+
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMFileWrite(int filedescriptor, void *data, int *length) {
+	TVMStatus InternalFileWrite(int filedescriptor, void *data, int *length) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		
-		if(filedescriptor < 3) {
-			InternalFileWrite(filedescriptor, data, length);
-		} else {
-			if(openFiles[filedescriptor]) {
-				struct FileEntry* curFile = openFiles[filedescriptor];
-				//std::cout << "finds file is open" << std::endl;
-				//std::cout << "flags " << curFile->flags << std::endl;
-				if ((curFile->flags & O_ACCMODE) > 0) {
-
-					uint8_t writeBuffer[bpb->SecPerClus * 512];
-					memcpy(&(writeBuffer[(curFile->curOffset)]), data, *length);
-					WriteCluster(curFile->curCluster, writeBuffer);
+		if (data && length) {
+			if (sharedLeased(data, *length)) {
+				// leased buffer is already shared memory, the machine writes straight from it
+				int expected = *length;
+				int callbacksReturned = 0;
+				struct fileWriteData fileData;
+				fileData.thread = curThread;
+				fileData.numBytes = length;
+				fileData.sectionIndex = 0;
+				fileData.numCallbacksDone = &callbacksReturned;
+				fileData.numCallbacksNeeded = 1;
+				traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+				curThread->ioPending += 1;
+				MachineFileWrite(filedescriptor, data, *length, &fileWriteCallback, &fileData);
+				makeWaiting(curThread);
+				scheduler();
 
-					curFile->rootEntry->entry->DSize += *length;
-					curFile->curOffset += *length;
+				MachineResumeSignals(&sigstate);
+				return (*length < expected) ? VM_STATUS_FAILURE : VM_STATUS_SUCCESS;
+			}
 
-					//std::cout << "offset in file" << curFile->curOffset << std::endl;
-					//std::cout << "Entry Num" << curFile->rootEntry->entryNum << std::endl;
+			int bytesWritten = 0;
+			int bytesLeft = *length;
+			bool failed = false;
 
-					//change date modified in the entry
-					VMDateTime(&(curFile->rootEntry->entry->DModify));
+			unsigned char *fileStart = (unsigned char*)data;
 
-					uint16_t dateModified = 0;
-					uint16_t timeModified = 0; //placeholder
-					encodeDateStruct(&(curFile->rootEntry->entry->DModify), &dateModified, &timeModified);
+			while (bytesLeft > 0 && !failed) {
+				// one block as big as what is left when the buddy allocator has it, more smaller blocks when it doesn't
+				unsigned char *blocks[maxIOInFlight];
+				int bytesUsed[maxIOInFlight];
+				int numSectionsNeeded = 0;
+				while (numSectionsNeeded < maxIOInFlight && bytesLeft > 0) {
+					TVMMemorySize blockSize;
+					blocks[numSectionsNeeded] = (unsigned char*)sharedAlloc(bytesLeft, &blockSize);
+					if (!blocks[numSectionsNeeded]) {
+						break;
+					}
+					bytesUsed[numSectionsNeeded] = (bytesLeft < (int)blockSize) ? bytesLeft : blockSize;
+					bytesLeft -= bytesUsed[numSectionsNeeded];
+					numSectionsNeeded += 1;
+				}
 
-					uint8_t sectorBuffer[512];
-					uint8_t entryArray[32];
-					int bufferIndex = (32 * curFile->rootEntry->entryNum);
+				if (numSectionsNeeded == 0) {
+					curThread->memoryWanted = memSectionSize;	// any block will do, the transfer gets split
+					queuePush(&waitingOnMemory, &(curThread->schedLink));
+					setState(curThread, VM_THREAD_STATE_WAITING);
+					scheduler();
+					continue;
+				}
 
-					ReadSector(fatInformation->FirstRootSector, sectorBuffer);
+				// every block goes in flight at once, only the last completion wakes the thread
+				int callbacksReturned = 0;
+				int results[maxIOInFlight];
+				struct fileWriteData fileData[maxIOInFlight];	// lives until every callback is back
+
+				for (int i = 0; i < numSectionsNeeded; i++) {
+
+					fileData[i].thread = curThread;
+					fileData[i].numBytes = &(results[i]);
+					fileData[i].sectionIndex = i;
+					fileData[i].numCallbacksDone = &callbacksReturned;
+					fileData[i].numCallbacksNeeded = numSectionsNeeded;
+
+					//memcopy to shared memory, by block
+					memcpy(blocks[i], fileStart, bytesUsed[i]);
+					fileStart = fileStart + bytesUsed[i];
+					traceRecord(TRACE_IO_SUBMIT, curThread->tid, filedescriptor);
+					curThread->ioPending += 1;
+					MachineFileWrite(filedescriptor, blocks[i], bytesUsed[i], &fileWriteCallback, &(fileData[i]));
+				}
 
-					memcpy(entryArray, &(sectorBuffer[bufferIndex]), 32);
-					memcpy(&(entryArray[22]), &timeModified, 2);
-					memcpy(&(entryArray[24]), &dateModified, 2);
-					memcpy(&(entryArray[28]), &(curFile->rootEntry->entry->DSize), 4);
-					// for future may not want 
-					
-					memcpy(&(sectorBuffer[bufferIndex]), entryArray, 32);
-					WriteSector(fatInformation->FirstRootSector, sectorBuffer);
+				makeWaiting(curThread);
+				scheduler();
 
+				for (int i = 0; i < numSectionsNeeded; i++) {
+					if (results[i] < bytesUsed[i]) {
+						failed = true;	// error or short write
+					}
+					if (results[i] > 0) {
+						bytesWritten += results[i];
+					}
 
-				} else {
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_FAILURE;
+					sharedFree(blocks[i]);
 				}
+			}
 
-			} else {
+			*length = bytesWritten;
+
+			if (failed) {
 				MachineResumeSignals(&sigstate);
 				return VM_STATUS_FAILURE;
+			} else {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_SUCCESS;
 			}
+		} else {
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	void fileReadCallback(void* calldata, int result) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
+	void sectorCacheInit() {
+		sectorCacheIndex.clear();
+		for (int i = 0; i < sectorCacheSize; i++) {
+			sectorCache[i].sector = -1;
+			sectorCache[i].dirty = false;
+			sectorCache[i].prev = i - 1;
+			sectorCache[i].next = (i + 1 < sectorCacheSize) ? i + 1 : -1;
+		}
+		sectorCacheHead = 0;
+		sectorCacheTail = sectorCacheSize - 1;
+	}
 
- 		struct fileReadData *data = (struct fileReadData *)calldata;
-		*(data->numBytes) = result;
-		struct Thread *thread = data->thread;
+	void sectorCacheTouch(int slot) {
+		if (slot == sectorCacheHead) {
+			return;
+		}
 
-		*(data->numCallbacksDone) += 1;
+		// unlink, then put at the front as most recently used
+		struct CachedSector *entry = &(sectorCache[slot]);
+		sectorCache[entry->prev].next = entry->next;
+		if (entry->next >= 0) {
+			sectorCache[entry->next].prev = entry->prev;
+		} else {
+			sectorCacheTail = entry->prev;
+		}
+		entry->prev = -1;
+		entry->next = sectorCacheHead;
+		sectorCache[sectorCacheHead].prev = slot;
+		sectorCacheHead = slot;
+	}
 
-		removeFromWaiting(thread);
-		makeReady(thread);
+	// a write replaces the cached copy and marks it dirty, a read fill that finds the sector already cached
+	// copies the cached one out instead since it may be newer than what was just read from the image
+	void sectorCacheInsert(int secNum, void* data, bool write) {
+		int slot;
+		while (true) {
+			std::map<int, int>::iterator found = sectorCacheIndex.find(secNum);
+			if (found != sectorCacheIndex.end()) {
+				slot = found->second;
+				if (!write) {
+					memcpy(data, sectorCache[slot].data, 512);
+					sectorCacheTouch(slot);
+					return;
+				}
+				break;
+			}
 
-		MachineResumeSignals(&sigstate);	
+			// reuse the least recently used slot, if it's dirty everything dirty goes out first
+			slot = sectorCacheTail;
+			if (sectorCache[slot].sector >= 0 && sectorCache[slot].dirty) {
+				sectorCacheFlush();	// blocks, so the sector may be cached and the tail different afterwards
+				continue;
+			}
+			if (sectorCache[slot].sector >= 0) {
+				sectorCacheIndex.erase(sectorCache[slot].sector);
+				sectorCacheEvictions += 1;
+			}
+			sectorCache[slot].sector = secNum;
+			sectorCacheIndex[secNum] = slot;
+			break;
+		}
+
+		memcpy(sectorCache[slot].data, data, 512);
+		sectorCache[slot].dirty = write && sectorWriteBack;
+		sectorCacheTouch(slot);
 	}
 
-	TVMStatus InternalFileRead(int filedescriptor, void *data, int *length) {
+	void sectorCacheFlush() {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		if (data && length) {
-			int bytesRead = 0;
-			int callbacksReturned = 0;
-			//find out how many sections you need to acquire
-			int numSectionsNeeded = (int)(*length / memSectionSize);
 
-			int remainderBytes = *length % memSectionSize;
-			if(remainderBytes != 0) {
-				numSectionsNeeded += 1;
+		std::vector<int> dirtySectors;	// in map order, so sorted and neighbours are next to each other
+		for (std::map<int, int>::iterator it = sectorCacheIndex.begin(); it != sectorCacheIndex.end(); ++it) {
+			if (sectorCache[it->second].dirty) {
+				dirtySectors.push_back(it->first);
 			}
-			int numSectionsAcquired = 0;
-
-			unsigned char *fileStart = (unsigned char*)data;
+		}
 
-			int numAvailable = availableMemorySection.size();
-			for(int i = 0; i < numSectionsNeeded; i++) {
-				if(numSectionsAcquired >= numSectionsNeeded) {
-					// done with all sections needed
+		std::vector<uint8_t> run;
+		unsigned int i = 0;
+		while (i < dirtySectors.size()) {
+			// each write blocks, so a later sector may have been flushed or evicted by another thread since the snapshot
+			int first = dirtySectors[i];
+			int count = 0;
+			run.clear();
+			while (i < dirtySectors.size() && dirtySectors[i] == first + count) {
+				std::map<int, int>::iterator found = sectorCacheIndex.find(dirtySectors[i]);
+				if (found == sectorCacheIndex.end() || !sectorCache[found->second].dirty) {
 					break;
-				} else {
-						if (numAvailable > 0) {
-							struct SharedMemorySection *firstAvailable = availableMemorySection.front();
-							availableMemorySection.pop();
+				}
+				run.resize((count + 1) * 512);
+				memcpy(&(run[count * 512]), sectorCache[found->second].data, 512);
+				sectorCache[found->second].dirty = false;	// cleared before the write, a write while it's out dirties it again
+				count++;
+				i++;
+			}
+
+			if (count == 0) {
+				i++;
+			} else {
+				imageTransfer(first, &(run[0]), count, true);	// one seek and one write per run of sectors
+			}
+		}
+
+		MachineResumeSignals(&sigstate);
+	}
 
-							firstAvailable->unlocked = false;
-							numSectionsAcquired += 1;
+	void imageTransfer(int secNum, void* data, int count, bool write) {
+		VMMutexAcquire(imageLock, VM_TIMEOUT_INFINITE);
+		InternalFileSeek(fatFileDescriptor, secNum * 512, 0, NULL);
+		int length = count * 512;
+		if (write) {
+			InternalFileWrite(fatFileDescriptor, data, &length);
+			sectorCacheWrites += count;
+		} else {
+			InternalFileRead(fatFileDescriptor, data, &length);
+		}
+		VMMutexRelease(imageLock);
+	}
 
-							struct fileReadData *fileData = new struct fileReadData;
-							fileData->thread = curThread;
-							fileData->numBytes = &bytesRead;
-							fileData->numCallbacksDone = &callbacksReturned;
-							fileData->numCallbacksNeeded = numSectionsNeeded;
+	void flusher(void *param) {
+		while (true) {
+			VMThreadSleep(flushIntervalTicks);
+			sectorCacheFlush();
+		}
+	}
 
+	void prefetcher(void *param) {
+		std::vector<uint8_t> buffer;
+		while (true) {
+			TMachineSignalState sigstate;
+			MachineSuspendSignals(&sigstate);
+			if (readaheadQueue.empty()) {
+				waitBlock(&readaheadWaiting, VM_TIMEOUT_INFINITE);
+				MachineResumeSignals(&sigstate);
+				continue;
+			}
 
-							if (numSectionsAcquired == numSectionsNeeded && remainderBytes != 0) {	// last section, length to write is remainder (max of 512)
-								firstAvailable->bytesUsed = remainderBytes;
-							} else {
-								firstAvailable->bytesUsed = memSectionSize; // full section, length to write is 512
-							}
+			// queued clusters that are also next to each other on the image are read as one extent,
+			// short enough that ReadClusters keeps it in the cache
+			int maxClusters = maxCachedRun / bpb->SecPerClus;
+			int first = readaheadQueue.front();
+			int count = 1;
+			readaheadQueue.pop_front();
+			while (!readaheadQueue.empty() && readaheadQueue.front() == first + count && count < maxClusters) {
+				readaheadQueue.pop_front();
+				count++;
+			}
 
-							MachineFileRead(filedescriptor, firstAvailable->startOfSection, firstAvailable->bytesUsed, &fileReadCallback, fileData);	
+			buffer.resize(count * bpb->SecPerClus * 512);
+			ReadClusters(first, &(buffer[0]), count);
+			MachineResumeSignals(&sigstate);
+		}
+	}
 
-							makeWaiting(curThread);
-							curThread->sleepDuration = -1;
-							scheduler();
+	bool clusterCached(int clusterNum) {
+		int secNum = fatInformation->FirstDataSector + (clusterNum - 2) * bpb->SecPerClus;
+		for (int i = 0; i < bpb->SecPerClus; i++) {
+			if (sectorCacheIndex.find(secNum + i) == sectorCacheIndex.end()) {
+				return false;
+			}
+		}
+		return true;
+	}
 
-							memcpy(fileStart, firstAvailable->startOfSection, firstAvailable->bytesUsed);
-							fileStart = fileStart + firstAvailable->bytesUsed;
+	// called after each read with the count clusters it covered, consecutive in the chain starting at cluster,
+	// and whether the first of them was cached beforehand
+	void readaheadUpdate(struct FileEntry *file, int cluster, int count, bool cached) {
+		if (count == 1 && cluster == file->lastCluster) {
+			return;	// still inside the same cluster
+		}
 
-							firstAvailable->unlocked = true;
-							availableMemorySection.push(firstAvailable);
+		bool sequential = (file->lastCluster == 0 && cluster == file->rootEntry->FstClusLO)
+			|| (file->lastCluster >= 2 && fatTable[file->lastCluster] == cluster);
+		file->lastCluster = cluster + count - 1;
+		if (!sequential) {
+			// random access, stop fetching ahead until reads follow the chain again
+			file->readaheadWindow = 0;
+			readaheadCancel(file);
+			return;
+		}
 
-							delete fileData;
+		int maxWindow = maxCachedRun / bpb->SecPerClus;
+		if (maxWindow > maxReadaheadClusters) {
+			maxWindow = maxReadaheadClusters;
+		} else if (maxWindow < 1) {
+			return;	// a single cluster is too big to be cached, reading it ahead would be wasted
+		}
 
-							if (bytesRead < 0) {
-								MachineResumeSignals(&sigstate);
-								return VM_STATUS_FAILURE;
-							}
-						} else {
-							waitingOnMemory.push(curThread);
-							curThread->sleepDuration = -1;
-							curThread->state = VM_THREAD_STATE_WAITING;
-							scheduler();
-						}
+		// the clusters just read are done with, any the prefetcher hasn't got to don't need fetching now
+		bool reached = false;
+		while (!file->readaheadClusters.empty() && file->readaheadClusters.front() >= cluster && file->readaheadClusters.front() < cluster + count) {
+			std::deque<int>::iterator queued = std::find(readaheadQueue.begin(), readaheadQueue.end(), file->readaheadClusters.front());
+			if (queued != readaheadQueue.end()) {
+				readaheadQueue.erase(queued);
+			}
+			file->readaheadClusters.pop_front();
+			reached = true;
+		}
+		if (reached) {
+			if (cached) {
+				// got here after the fetch finished, fetch further ahead next time
+				readaheadHits += 1;
+				file->readaheadWindow *= 2;
+			}
+		} else if (file->readaheadWindow == 0) {
+			file->readaheadWindow = 1;
+		}
+		if (file->readaheadWindow > maxWindow) {
+			file->readaheadWindow = maxWindow;
+		}
 
+		// top up to the window along the chain
+		bool queued = false;
+		int next = file->readaheadClusters.empty() ? file->lastCluster : file->readaheadClusters.back();
+		while ((int)file->readaheadClusters.size() < file->readaheadWindow) {
+			next = fatTable[next];
+			if (next < 2 || next >= 0xFFF8 || (unsigned int)next >= fatTable.size()) {
+				break;	// end of the file
+			}
+			file->readaheadClusters.push_back(next);
+			readaheadQueue.push_back(next);
+			readaheadIssued += 1;
+			queued = true;
+		}
 
-					}
-				}
+		if (queued && readaheadWaiting.size != 0) {
+			struct Thread *waiter = queuePop(&readaheadWaiting);
+			waitWake(waiter);
+			if (waiter->priority > curThread->priority) {	// run it now instead of at the next tick
+				scheduler();
+			}
+		}
+	}
 
-			*length = bytesRead;
-			
-			if (bytesRead < 0) {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_FAILURE;
-			} else {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_SUCCESS;
+	// drops the file's clusters the prefetcher hasn't got to yet, so they don't push useful sectors out of the cache
+	void readaheadCancel(struct FileEntry *file) {
+		for (unsigned int i = 0; i < file->readaheadClusters.size(); i++) {
+			std::deque<int>::iterator queued = std::find(readaheadQueue.begin(), readaheadQueue.end(), file->readaheadClusters[i]);
+			if (queued != readaheadQueue.end()) {
+				readaheadQueue.erase(queued);
 			}
-		} else {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		file->readaheadClusters.clear();
+	}
+
+	TVMStatus VMReadaheadQuery(unsigned int *issued, unsigned int *hits) {
+		TMachineSignalState sigstate;
+		MachineSuspendSignals(&sigstate);
+		if (issued) {
+			*issued = readaheadIssued;
+		}
+		if (hits) {
+			*hits = readaheadHits;
 		}
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_SUCCESS;
 	}
 
-	void fileSeekCallback(void* calldata, int result) {
+	TVMStatus VMSectorCacheQuery(unsigned int *hits, unsigned int *misses, unsigned int *evictions, unsigned int *writes) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
+		if (hits) {
+			*hits = sectorCacheHits;
+		}
+		if (misses) {
+			*misses = sectorCacheMisses;
+		}
+		if (evictions) {
+			*evictions = sectorCacheEvictions;
+		}
+		if (writes) {
+			*writes = sectorCacheWrites;
+		}
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-		struct fileSeekData *data = (struct fileSeekData *)calldata;
-		*(data->curOffset) = result;
-		struct Thread *thread = data->thread;
-		removeFromWaiting(thread);
-		makeReady(thread);
-
-		MachineResumeSignals(&sigstate);	
-	}	
-
-	TVMStatus InternalFileSeek(int filedescriptor, int offset, int whence, int *newoffset) {
+	TVMStatus VMSectorCacheWriteBack(int enable) {
 		TMachineSignalState sigstate;
 		MachineSuspendSignals(&sigstate);
-		int result = 0;
+		if (!enable) {
+			sectorCacheFlush();	// nothing can be left dirty once writes go straight through
+		}
+		sectorWriteBack = (enable != 0);
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
 
-		struct fileSeekData *fileData = new struct fileSeekData;
-		fileData->thread = curThread;
-		if (newoffset) {
-			fileData->curOffset = newoffset;
-		} else {
-			fileData->curOffset = &result;
+	TVMStatus ReadSector(int secNum, void* data) {
+		std::map<int, int>::iterator found = sectorCacheIndex.find(secNum);
+		if (found != sectorCacheIndex.end()) {
+			sectorCacheHits += 1;
+			memcpy(data, sectorCache[found->second].data, 512);
+			sectorCacheTouch(found->second);
+			return VM_STATUS_SUCCESS;
 		}
-		
-		MachineFileSeek(filedescriptor, offset, whence, &fileSeekCallback, fileData);
+		sectorCacheMisses += 1;
 
-		makeWaiting(curThread);
-		curThread->sleepDuration = -1;
-		scheduler();
+		imageTransfer(secNum, data, 1, false);
 
-		delete fileData;
+		// filled in after the read so a thread that ran while this one was blocked can't see a half loaded slot,
+		// and if one of them cached the sector in the meantime its copy is the one kept
+		sectorCacheInsert(secNum, data, false);
+		return VM_STATUS_SUCCESS;
+	}
 
-		if (result < 0) {
-			MachineResumeSignals(&sigstate);	
-			return VM_STATUS_FAILURE;
-		} else {
-			MachineResumeSignals(&sigstate);	
-			return VM_STATUS_SUCCESS;
+	TVMStatus WriteSector(int secNum, void* data) {
+		sectorCacheInsert(secNum, data, true);
+		if (!sectorWriteBack) {
+			imageTransfer(secNum, data, 1, true);	// write through
 		}
-		MachineResumeSignals(&sigstate);	
 		return VM_STATUS_SUCCESS;
 	}
 
-	void skeleton (void *data) {
-		MachineEnableSignals();
-
-		curThread->threadEntry(curThread->parameter);
+	// a run of sectors with one seek and one transfer, any that are cached are served from the cache
+	// short runs are cached afterwards like single sectors, long ones are left out the same as in WriteSectors
+	TVMStatus ReadSectors(int secNum, void* data, int count) {
+		uint8_t *bytes = (uint8_t*)data;
+		int cached = 0;
+		for (int i = 0; i < count; i++) {
+			if (sectorCacheIndex.find(secNum + i) != sectorCacheIndex.end()) {
+				cached++;
+			}
+		}
+		if (cached == count) {
+			sectorCacheHits += count;
+			for (int i = 0; i < count; i++) {
+				std::map<int, int>::iterator found = sectorCacheIndex.find(secNum + i);
+				memcpy(&(bytes[i * 512]), sectorCache[found->second].data, 512);
+				sectorCacheTouch(found->second);
+			}
+			return VM_STATUS_SUCCESS;
+		}
 
-		VMThreadTerminate(curThread->tid);
+		sectorCacheMisses += count;	// the whole run came from the image
+		unsigned int writesBefore = sectorCacheWrites;
+		imageTransfer(secNum, data, count, false);
+
+		// cached copies can be newer than the image, and the transfer may have blocked while one was written
+		// a write that went around the cache while the read was out could make this copy stale, so it isn't kept then
+		bool keep = (count <= maxCachedRun && sectorCacheWrites == writesBefore);
+		for (int i = 0; i < count; i++) {
+			if (keep) {
+				sectorCacheInsert(secNum + i, &(bytes[i * 512]), false);
+				continue;
+			}
+			std::map<int, int>::iterator found = sectorCacheIndex.find(secNum + i);
+			if (found != sectorCacheIndex.end()) {
+				memcpy(&(bytes[i * 512]), sectorCache[found->second].data, 512);
+				sectorCacheTouch(found->second);
+			}
+		}
+		return VM_STATUS_SUCCESS;
 	}
 
-	TVMStatus VMMutexCreate(TVMMutexIDRef mutexref) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
+	// short runs are cached like single sectors and go out together on a flush, long ones go straight to the image
+	// so a large write doesn't push the metadata sectors out of the cache
+	TVMStatus WriteSectors(int secNum, void* data, int count) {
+		uint8_t *bytes = (uint8_t*)data;
+		if (sectorWriteBack && count <= maxCachedRun) {
+			for (int i = 0; i < count; i++) {
+				sectorCacheInsert(secNum + i, &(bytes[i * 512]), true);
+			}
+			return VM_STATUS_SUCCESS;
+		}
 
-		if(mutexref){
-			struct Mutex* newMutex = new struct Mutex;
-			newMutex->unlocked = true;
-			newMutex->id = allMutexes.size();
+		for (int i = 0; i < count; i++) {
+			std::map<int, int>::iterator found = sectorCacheIndex.find(secNum + i);
+			if (found != sectorCacheIndex.end()) {
+				// kept dirty so a flush that copied the old data before this write can't leave it on the image
+				memcpy(sectorCache[found->second].data, &(bytes[i * 512]), 512);
+				sectorCache[found->second].dirty = sectorWriteBack;
+			}
+		}
+		imageTransfer(secNum, data, count, true);
+		return VM_STATUS_SUCCESS;
+	}
 
-			TVMMutexID newId = newMutex->id;
-			*mutexref = newId;
+	TVMStatus ReadCluster(int clusterNum, void* data) {
+		return ReadClusters(clusterNum, data, 1);
+	}
 
-			if (allMutexes.find(newId) == allMutexes.end()) {
-				allMutexes[newId] = newMutex;	// add to all mutexes if not found already
-			} else {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_PARAMETER;	// ID has already been used (should never happen but just in case)
-			}
+	TVMStatus WriteCluster(int clusterNum, void* data) {
+		return WriteClusters(clusterNum, data, 1);
+	}
 
-		} else {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_PARAMETER; // invalid mutex ref
+	// count clusters that are next to each other on the image, clusterRun says how many of a chain are
+	TVMStatus ReadClusters(int clusterNum, void* data, int count) {
+		if (clusterNum < 2 || count < 1 || (unsigned int)(clusterNum + count) > fatTable.size()) {
+			return VM_STATUS_FAILURE;
 		}
-
-		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
+		int secNum = fatInformation->FirstDataSector + (clusterNum - 2) * bpb->SecPerClus;
+		return ReadSectors(secNum, data, count * bpb->SecPerClus);
 	}
 
-	TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
-		if(ownerref) {
-			if (allMutexes.find(mutex) == allMutexes.end()) {	// mutex id does not exist
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_ID;
-			} else {
-				struct Mutex *foundMutex = allMutexes.at(mutex);
-				if(foundMutex->unlocked == true) {	// thread is unlocked, cannot store owner
-					*ownerref = VM_THREAD_ID_INVALID;
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_SUCCESS;
-				} else {
-					*ownerref = foundMutex->owner;	// store mutex owner in ownerref
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_SUCCESS;
-				}
-			}
-		} else {	// ownerref does not exist
-			MachineResumeSignals(&sigstate);	
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
+	TVMStatus WriteClusters(int clusterNum, void* data, int count) {
+		if (clusterNum < 2 || count < 1 || (unsigned int)(clusterNum + count) > fatTable.size()) {
+			return VM_STATUS_FAILURE;
 		}
+		int secNum = fatInformation->FirstDataSector + (clusterNum - 2) * bpb->SecPerClus;
+		return WriteSectors(secNum, data, count * bpb->SecPerClus);
+	}
 
-		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
-		
+	// how many clusters of the chain starting at clusterNum are also consecutive on the image, at most maxClusters
+	int clusterRun(int clusterNum, int maxClusters) {
+		int count = 1;
+		while (count < maxClusters && fatTable[clusterNum + count - 1] == clusterNum + count) {
+			count++;
+		}
+		return count;
 	}
 
-	TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
 
-		if(allMutexes.find(mutex) == allMutexes.end()) {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_ID;
-		} else {
-			struct Mutex *foundMutex = allMutexes.at(mutex);
+	void freeSpaceInit() {
+		// clusters 0 and 1 are reserved, and the FAT's last sector can have entries past the end of the volume
+		unsigned int clusterLimit = fatInformation->ClusterCount + 2;
+		if (clusterLimit > fatTable.size()) {
+			clusterLimit = fatTable.size();
+		}
 
-			if(timeout == VM_TIMEOUT_IMMEDIATE) {	// immediate, either get or fail to get mutex this moment
-				if(foundMutex->unlocked == false) {
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_FAILURE;
-				} else {
-					if(foundMutex->waitingMutex.empty()) {
-						foundMutex->unlocked = false;
-						foundMutex->owner = curThread->tid;
-						curThread->mutexesOwned.push(mutex);
-						MachineResumeSignals(&sigstate);
-						return VM_STATUS_SUCCESS;
-					} else {
-						MachineResumeSignals(&sigstate);
-						return VM_STATUS_FAILURE;
-					}
-				}
-			} else if (timeout == VM_TIMEOUT_INFINITE) {
-				if(foundMutex->unlocked == false) {
-					foundMutex->waitingMutex.push(curThread);	// add it to waiting, schedule new thread
-					waitingOnMutex.push(curThread);
-					curThread->timeoutDuration = timeout;
-					curThread->state = VM_THREAD_STATE_WAITING;
-					scheduler();
-				} else {
-					foundMutex->unlocked = false;
-					foundMutex->owner = curThread->tid;
-					curThread->mutexesOwned.push(mutex);
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_SUCCESS;
+		clusterFree.assign(clusterLimit, false);
+		freeExtents.clear();
+		freeExtentsBySize.clear();
+		int runFirst = -1;
+		for (unsigned int i = 2; i < clusterLimit; i++) {
+			if (fatTable[i] == 0x0000) {
+				clusterFree[i] = true;
+				if (runFirst < 0) {
+					runFirst = i;
 				}
-			} else {
-				if(foundMutex->unlocked == true) {	// is free to be acquired
-						foundMutex->unlocked = false;
-						foundMutex->owner = curThread->tid;
-						curThread->mutexesOwned.push(mutex);
-				} else {
-					foundMutex->waitingMutex.push(curThread);	// add it to waiting, schedule new thread
-					waitingOnMutex.push(curThread);
-					curThread->timeoutDuration = timeout;
-					curThread->state = VM_THREAD_STATE_WAITING;
-					scheduler();
-					// when wakes up after timeout
-					if(foundMutex->unlocked == true) {	// is free to be acquired
-						if(foundMutex->waitingMutex.empty()) {	//no others waiting, can become thread rn
-							foundMutex->unlocked = false;
-							foundMutex->owner = curThread->tid;
-							curThread->mutexesOwned.push(mutex);
-						} else {
-							// remove from the waiting of the mutex
-							int mutexWaiting = foundMutex->waitingMutex.size();
-							for (int i = 0; i < mutexWaiting; i++) {
-								struct Thread *front = foundMutex->waitingMutex.front();
-								foundMutex->waitingMutex.pop();
-								if(front->tid == curThread->tid){
-									//don't push
-								} else {
-									foundMutex->waitingMutex.push(front);
-								}
-							}
+			} else if (runFirst >= 0) {
+				freeExtentAdd(runFirst, i - runFirst);
+				runFirst = -1;
+			}
+		}
+		if (runFirst >= 0) {
+			freeExtentAdd(runFirst, clusterLimit - runFirst);
+		}
+		clusterCursor = 2;
+	}
 
-							MachineResumeSignals(&sigstate);
-							return VM_STATUS_FAILURE;	// was not able to acquire was unlocked but others are waiting (should never happen but could be outlier)
-						} 
-					} else {
-							int mutexWaiting = foundMutex->waitingMutex.size();
-							for (int i = 0; i < mutexWaiting; i++) {
-								struct Thread *front = foundMutex->waitingMutex.front();
-								foundMutex->waitingMutex.pop();
-								if(front->tid == curThread->tid){
-									// don't push
-								} else {
-									foundMutex->waitingMutex.push(front);
-								}
-							}
+	void freeExtentAdd(int first, int count) {
+		freeExtents[first] = count;
+		freeExtentsBySize.insert(std::make_pair(count, first));
+	}
 
-						MachineResumeSignals(&sigstate);	// mutex was not unlocked
-						return VM_STATUS_FAILURE;
-					}
+	void freeExtentRemove(std::map<int, int>::iterator extent) {
+		freeExtentsBySize.erase(std::make_pair(extent->second, extent->first));
+		freeExtents.erase(extent);
+	}
+
+	// hands out up to wanted contiguous clusters, starting at goal if it's free so a growing file stays in one piece,
+	// otherwise the smallest run that fits them all, and failing that the largest run for multiple clusters
+	// or the next run from the cursor for one. returns the first cluster and the count in allocated, -1 if the volume is full.
+	// only the free space index changes, the caller links the clusters in with fatSet
+	int clusterAlloc(int goal, int wanted, int *allocated) {
+		if (freeExtents.empty() || wanted < 1) {
+			return -1;
+		}
+
+		std::map<int, int>::iterator extent;
+		int first;
+		if (goal >= 2 && (unsigned int)goal < clusterFree.size() && clusterFree[goal]) {
+			extent = freeExtents.upper_bound(goal);
+			--extent;	// the run goal is in
+			first = goal;
+		} else if (wanted > 1) {
+			std::set<std::pair<int, int> >::iterator fit = freeExtentsBySize.lower_bound(std::make_pair(wanted, 0));
+			if (fit == freeExtentsBySize.end()) {
+				--fit;	// nothing big enough, the largest gets as close as possible
+			}
+			extent = freeExtents.find(fit->second);
+			first = extent->first;
+		} else {
+			extent = freeExtents.upper_bound(clusterCursor);
+			first = -1;
+			if (extent != freeExtents.begin()) {
+				std::map<int, int>::iterator previous = extent;
+				--previous;
+				if (previous->first + previous->second > clusterCursor) {
+					extent = previous;	// cursor is inside this run
+					first = clusterCursor;
 				}
 			}
-
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_SUCCESS;
+			if (extent == freeExtents.end()) {
+				extent = freeExtents.begin();	// wrap around to the start of the volume
+			}
+			if (first < 0) {
+				first = extent->first;	// the run is wholly after the cursor, or before it after a wrap
+			}
 		}
-	}
 
-	TVMStatus VMMutexRelease(TVMMutexID mutex) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
+		// take the clusters out of the run, what's left on either side stays free
+		int runFirst = extent->first;
+		int runEnd = extent->first + extent->second;
+		int count = (runEnd - first < wanted) ? runEnd - first : wanted;
+		assert(count > 0);	// first has to be inside the run
+		freeExtentRemove(extent);
+		if (first > runFirst) {
+			freeExtentAdd(runFirst, first - runFirst);
+		}
+		if (first + count < runEnd) {
+			freeExtentAdd(first + count, runEnd - (first + count));
+		}
+		for (int i = 0; i < count; i++) {
+			clusterFree[first + i] = false;
+		}
 
-		if(allMutexes.find(mutex) == allMutexes.end()) {	//mutex not valid
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_ID;
-		} else {
-			struct Mutex *foundMutex = allMutexes.at(mutex);	//finds mutex
-			if (foundMutex->owner != curThread->tid) {	// if curThread is not the owner
+		clusterCursor = first + count;
+		*allocated = count;
+		return first;
+	}
 
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_STATE;
-			} else {
-				struct Thread *oldOwner = allThreads.at(foundMutex->owner);
-				removeFromOwned(oldOwner, mutex);
+	void clusterRelease(int first, int count) {
+		for (int i = 0; i < count; i++) {
+			clusterFree[first + i] = true;
+		}
 
-				if (foundMutex->waitingMutex.empty()) {
-					foundMutex->owner = -1; // no owner, need placeholder
-					foundMutex->unlocked = true;
-				} else {
-					struct Thread* nextOwner = foundMutex->waitingMutex.front();	// once released, get next owner
-					foundMutex->waitingMutex.pop();
-					removeFromWaitingOnMutex(nextOwner);
-					nextOwner->mutexesOwned.push(foundMutex->id);
-					foundMutex->owner = nextOwner->tid;
-					makeReady(nextOwner);
-					if(nextOwner->priority > curThread->priority) {	// need to schedule if higher priority
-						scheduler();
-					}
-				}
+		// merge with the free runs on either side
+		std::map<int, int>::iterator next = freeExtents.find(first + count);
+		if (next != freeExtents.end()) {
+			count += next->second;
+			freeExtentRemove(next);
+		}
+		std::map<int, int>::iterator previous = freeExtents.lower_bound(first);
+		if (previous != freeExtents.begin()) {
+			--previous;
+			if (previous->first + previous->second == first) {
+				first = previous->first;
+				count += previous->second;
+				freeExtentRemove(previous);
 			}
 		}
+		freeExtentAdd(first, count);
+	}
 
-		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
+	// changes one FAT entry and the FAT sector holding it, 256 entries per sector
+	void fatSet(int cluster, uint16_t value) {
+		fatTable[cluster] = value;
+		int fatSector = cluster / 256;
+		WriteSector(1 + fatSector, &(fatTable[fatSector * 256]));
 	}
 
-	TVMStatus VMMutexDelete(TVMMutexID mutex) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
+	// FNV-1a over the 11 name characters, upper cased so lookups ignore case like strcasecmp did
+	unsigned int directoryHash(const char *shortName) {
+		unsigned int hash = 2166136261u;
+		for (int i = 0; i < 11; i++) {
+			hash ^= (unsigned char)toupper((unsigned char)shortName[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
 
-		if(allMutexes.find(mutex) == allMutexes.end()) {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_ID;
-		} else {
-			struct Mutex *foundMutex = allMutexes.at(mutex);
-			if(foundMutex->unlocked == false) {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_ERROR_INVALID_STATE; 
-			} else {
-				allMutexes.erase(foundMutex->id);
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_SUCCESS;
+	void directoryIndexInit() {
+		unsigned int buckets = 16;
+		while (buckets < bpb->RootEntCnt) {
+			buckets <<= 1;	// at most one entry per bucket on average when the directory is full
+		}
+		directoryIndex.assign(buckets, (struct DirectoryEntry*)NULL);
+		for (unsigned int i = 0; i < rootDirectories.size(); i++) {
+			directoryIndexInsert(rootDirectories[i]);
+		}
+
+		freeDirectorySlots.clear();
+		for (int i = 0; i < bpb->RootEntCnt; i++) {
+			if (rootData[i * 32] == 0x00 || rootData[i * 32] == 0xE5) {
+				freeDirectorySlots.insert(i);
 			}
 		}
 	}
 
-	TVMStatus InternalFileWrite(int filedescriptor, void *data, int *length) {
-		TMachineSignalState sigstate;
-		MachineSuspendSignals(&sigstate);
-		if (data && length) {
-
-			int bytesWritten = 0;
-			
-			int callbacksReturned = 0;
-			//find out how many sections you need to acquire
-			int numSectionsNeeded = (int)(*length / memSectionSize);
+	void directoryIndexInsert(struct DirectoryEntry *entry) {
+		unsigned int bucket = directoryHash(entry->entry->DShortFileName) & (directoryIndex.size() - 1);
+		entry->hashNext = directoryIndex[bucket];
+		directoryIndex[bucket] = entry;
+	}
 
-			int remainderBytes = *length % memSectionSize;
-			if(remainderBytes != 0) {
-				numSectionsNeeded += 1;
+	void directoryIndexRemove(struct DirectoryEntry *entry) {
+		unsigned int bucket = directoryHash(entry->entry->DShortFileName) & (directoryIndex.size() - 1);
+		struct DirectoryEntry **link = &(directoryIndex[bucket]);
+		while (*link) {
+			if (*link == entry) {
+				*link = entry->hashNext;
+				return;
 			}
-			int numSectionsAcquired = 0;
-
-			unsigned char *fileStart = (unsigned char*)data;
+			link = &((*link)->hashNext);
+		}
+	}
 
-			//acquire next available memory section
-			int numAvailable = availableMemorySection.size();
-			for(int i = 0; i < numSectionsNeeded; i++) {
-				if(numSectionsAcquired >= numSectionsNeeded) {
-					// acquired all sections needed
-					break;
-				} else {
-						if (numAvailable > 0) {
-							struct SharedMemorySection *firstAvailable = availableMemorySection.front();
-							availableMemorySection.pop();
+	struct DirectoryEntry *directoryLookup(const char *shortName) {
+		unsigned int bucket = directoryHash(shortName) & (directoryIndex.size() - 1);
+		for (struct DirectoryEntry *entry = directoryIndex[bucket]; entry; entry = entry->hashNext) {
+			if (strncasecmp(entry->entry->DShortFileName, shortName, 11) == 0) {
+				return entry;
+			}
+		}
+		return NULL;
+	}
 
-							firstAvailable->unlocked = false;
-							numSectionsAcquired += 1;
+	int directorySlotAlloc() {
+		if (freeDirectorySlots.empty()) {
+			return -1;
+		}
+		int slot = *(freeDirectorySlots.begin());
+		freeDirectorySlots.erase(freeDirectorySlots.begin());
+		return slot;
+	}
 
-							struct fileWriteData *fileData = new struct fileWriteData;
-							fileData->thread = curThread;
-							fileData->numBytes = &bytesWritten;
-							fileData->numCallbacksDone = &callbacksReturned;
-							fileData->numCallbacksNeeded = numSectionsNeeded;
+	// copies a root entry from rootData into the root directory sector it lives in
+	void rootEntryWrite(int entryNum) {
+		rootEntryWriteBytes(entryNum, 0, 32);
+	}
 
+	// just count bytes of the entry from first on, so fields other code keeps up to date in the sector are left alone
+	void rootEntryWriteBytes(int entryNum, int first, int count) {
+		uint8_t sectorBuffer[512];
+		int rootSector = fatInformation->FirstRootSector + (32 * entryNum) / 512;
+		ReadSector(rootSector, sectorBuffer);
+		memcpy(&(sectorBuffer[((32 * entryNum) % 512) + first]), &(rootData[(32 * entryNum) + first]), count);
+		WriteSector(rootSector, sectorBuffer);
+	}
 
-							if (numSectionsAcquired == numSectionsNeeded && remainderBytes != 0) {	// last section, length to write is remainder (max of 512)
-								firstAvailable->bytesUsed = remainderBytes;
-							} else {
-								firstAvailable->bytesUsed = memSectionSize; // full section, length to write is 512
-							}
-							//memcopy to shared memory, by section
-							memcpy(firstAvailable->startOfSection, fileStart, firstAvailable->bytesUsed);
-							fileStart = fileStart + firstAvailable->bytesUsed;
-							MachineFileWrite(filedescriptor, firstAvailable->startOfSection, firstAvailable->bytesUsed, &fileWriteCallback, fileData);
+	void extentMapBuild(struct FileEntry *file) {
+		file->extents.clear();
+		int cluster = file->rootEntry->FstClusLO;
+		while (cluster >= 2 && cluster < 0xFFF8 && (unsigned int)cluster < fatTable.size()) {
+			extentMapAppend(file, cluster);
+			cluster = fatTable[cluster];
+		}
+		file->extentsBuilt = true;
+	}
 
-							makeWaiting(curThread);
-							curThread->sleepDuration = -1;
-							scheduler();
+	// adds the next cluster of the chain, growing the last run when it's the cluster right after it
+	void extentMapAppend(struct FileEntry *file, int cluster) {
+		if (file->extents.empty()) {
+			struct FileExtent extent = {cluster, 1, 0};
+			file->extents.push_back(extent);
+			return;
+		}
 
-							firstAvailable->unlocked = true;
-							availableMemorySection.push(firstAvailable);
+		struct FileExtent *last = &(file->extents.back());
+		if (last->firstCluster + last->clusters == cluster) {
+			last->clusters += 1;
+		} else {
+			struct FileExtent extent = {cluster, 1, last->offset + last->clusters * bpb->SecPerClus * 512};
+			file->extents.push_back(extent);
+		}
+	}
 
-							delete fileData;
+	// cluster holding byte offset of the file and the offset inside it, binary search over the runs.
+	// offset at the very end of the chain gives the last cluster with clusterOffset one cluster in, -1 if past the end
+	int extentMapLookup(struct FileEntry *file, unsigned int offset, int *clusterOffset) {
+		if (!file->extentsBuilt) {
+			extentMapBuild(file);
+		}
+		if (file->extents.empty()) {
+			*clusterOffset = 0;
+			return (offset == 0) ? file->rootEntry->FstClusLO : -1;	// no clusters yet
+		}
 
-							if (bytesWritten < 0) {
-								MachineResumeSignals(&sigstate);
-								return VM_STATUS_FAILURE;
-							}
-						} else {
-							waitingOnMemory.push(curThread);
-							curThread->sleepDuration = -1;
-							curThread->state = VM_THREAD_STATE_WAITING;
-							scheduler();
-						}
-					}
-				}
+		unsigned int clusterBytes = bpb->SecPerClus * 512;
+		struct FileExtent *last = &(file->extents.back());
+		unsigned int chainBytes = last->offset + last->clusters * clusterBytes;
+		if (offset > chainBytes) {
+			return -1;
+		} else if (offset == chainBytes) {
+			*clusterOffset = clusterBytes;
+			return last->firstCluster + last->clusters - 1;
+		}
 
-			if (bytesWritten < *length) {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_FAILURE;
+		// last run starting at or before offset
+		int low = 0;
+		int high = file->extents.size() - 1;
+		while (low < high) {
+			int middle = (low + high + 1) / 2;
+			if (file->extents[middle].offset <= offset) {
+				low = middle;
 			} else {
-				MachineResumeSignals(&sigstate);
-				return VM_STATUS_SUCCESS;
+				high = middle - 1;
 			}
-		} else {
-			MachineResumeSignals(&sigstate);
-			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
-		MachineResumeSignals(&sigstate);
-		return VM_STATUS_SUCCESS;
-	}
 
-	TVMStatus ReadSector(int secNum, void* data) {
-		//lock
-		//Seek(sec*512)
-		int offset = secNum * 512;
-		InternalFileSeek(fatFileDescriptor, offset, 0, NULL);
-		//Read 512 bytes
-		int length = 512;
-		InternalFileRead(fatFileDescriptor, data, &length);
-		//unlock
-		return VM_STATUS_SUCCESS;
-	}
-
-	TVMStatus WriteSector(int secNum, void* data) {
-		//lock
-		//Seek(sec*512)
-		int offset = secNum * 512;
-		InternalFileSeek(fatFileDescriptor, offset, 0, NULL);
-		//Read 512 bytes
-		int length = 512;
-		InternalFileWrite(fatFileDescriptor, data, &length);
-		//unlock
-		return VM_STATUS_SUCCESS;
+		unsigned int runOffset = offset - file->extents[low].offset;
+		*clusterOffset = runOffset % clusterBytes;
+		return file->extents[low].firstCluster + runOffset / clusterBytes;
 	}
 
-	TVMStatus ReadCluster(int clusterNum, void* data) {
-
+	// cluster after cluster in the file's chain. at the end of the chain up to wanted clusters are added,
+	// right after cluster on the image if they're free, returns -1 if the volume is full
+	int fileNextCluster(struct FileEntry *file, int cluster, int wanted) {
+		if (cluster >= 2) {
+			int next = fatTable[cluster];
+			if (next >= 2 && next < 0xFFF8) {
+				return next;
+			}
+		}
 
-		if(clusterNum == 0 || clusterNum == 1) {
+		if (!file->extentsBuilt) {
+			extentMapBuild(file);	// before the chain changes, the new clusters are appended below
+		}
+		int allocated;
+		int first = clusterAlloc(cluster + 1, wanted, &allocated);
+		if (first < 0) {
+			return -1;
+		}
 
-			return VM_STATUS_FAILURE;
+		for (int i = 0; i < allocated - 1; i++) {
+			fatSet(first + i, first + i + 1);
+		}
+		fatSet(first + allocated - 1, 0xFFFF);
+		if (cluster >= 2) {
+			fatSet(cluster, first);
 		} else {
-			for (int i = 0; i < bpb->SecPerClus; i++) {
-				// calculate starting point
-				int secNum = fatInformation->FirstDataSector + (clusterNum - 2) * bpb->SecPerClus + i;
-				ReadSector(secNum, data);
-			}
+			file->rootEntry->FstClusLO = first;	// file had no clusters yet
+		}
+		for (int i = 0; i < allocated; i++) {
+			extentMapAppend(file, first + i);
 		}
 
-
-		return VM_STATUS_SUCCESS;
+		// other descriptors on the same file rebuild their maps from the FAT next time they need them
+		for (unsigned int i = 3; i < openFiles.size(); i++) {
+			if (openFiles[i] && openFiles[i] != file && openFiles[i]->rootEntry == file->rootEntry) {
+				openFiles[i]->extentsBuilt = false;
+			}
+		}
+		return first;
 	}
 
-	TVMStatus WriteCluster(int clusterNum, void* data) {
+	// puts the size, first cluster and a new modify time of an open file in its root entry
+	void fileMetadataWrite(struct FileEntry *file) {
+		VMDateTime(&(file->rootEntry->entry->DModify));
+		uint16_t dateModified = 0;
+		uint16_t timeModified = 0;
+		encodeDateStruct(&(file->rootEntry->entry->DModify), &dateModified, &timeModified);
+
+		uint8_t *entryArray = &(rootData[32 * file->rootEntry->entryNum]);
+		memcpy(&(entryArray[22]), &timeModified, 2);
+		memcpy(&(entryArray[24]), &dateModified, 2);
+		memcpy(&(entryArray[26]), &(file->rootEntry->FstClusLO), 2);
+		memcpy(&(entryArray[28]), &(file->rootEntry->entry->DSize), 4);
+		rootEntryWriteBytes(file->rootEntry->entryNum, 22, 10);	// write time and date, FstClusLO and size
+	}
 
+	// writes length bytes at curCluster and curOffset, moving them along and growing the file as it goes.
+	// returns the bytes written, short if the volume fills. the caller updates the directory entry
+	int fileWrite(struct FileEntry *file, uint8_t *source, int length) {
+		unsigned int clusterBytes = bpb->SecPerClus * 512;
+		int bytesWritten = 0;
+		uint8_t writeBuffer[clusterBytes];
+
+		while (bytesWritten < length) {
+			int wanted = length - bytesWritten;
+			if (file->curCluster < 2 || (unsigned int)file->curOffset == clusterBytes) {
+				// on to the next cluster, at the end of the chain the rest of the write is allocated in one go
+				int next = fileNextCluster(file, file->curCluster, (wanted + clusterBytes - 1) / clusterBytes);
+				if (next < 0) {
+					break;	// volume is full
+				}
+				file->curCluster = next;
+				file->curOffset = 0;
+			}
 
-		if(clusterNum == 0 || clusterNum == 1) {
-			return VM_STATUS_FAILURE;
-		} else {
-			for (int i = 0; i < bpb->SecPerClus; i++) {
-				// calculate starting point
-				int secNum = fatInformation->FirstDataSector + (clusterNum - 2) * bpb->SecPerClus + i;
-				WriteSector(secNum, data);
+			int chunk;
+			if (file->curOffset == 0 && (unsigned int)wanted >= clusterBytes) {
+				// whole clusters go straight from source, as many at once as sit next to each other
+				int run = clusterRun(file->curCluster, wanted / clusterBytes);
+				chunk = run * clusterBytes;
+				WriteClusters(file->curCluster, &(source[bytesWritten]), run);
+				file->curCluster += run - 1;
+				file->curOffset = clusterBytes;
+			} else {
+				chunk = clusterBytes - file->curOffset;
+				if (chunk > wanted) {
+					chunk = wanted;
+				}
+				// keep the part of the cluster the file already has
+				if (file->position - file->curOffset < file->rootEntry->entry->DSize) {
+					ReadCluster(file->curCluster, writeBuffer);
+				} else {
+					memset(writeBuffer, 0, clusterBytes);
+				}
+				memcpy(&(writeBuffer[file->curOffset]), &(source[bytesWritten]), chunk);
+				WriteCluster(file->curCluster, writeBuffer);
+				file->curOffset += chunk;
 			}
+			bytesWritten += chunk;
+			file->position += chunk;
 		}
 
-		return VM_STATUS_SUCCESS;
+		if (file->position > file->rootEntry->entry->DSize) {
+			file->rootEntry->entry->DSize = file->position;
+		}
+		return bytesWritten;
 	}
 
+	// writes out what's collected in the write buffer, the directory entry is updated once for all of it
+	bool fileFlush(struct FileEntry *file) {
+		if (file->bufferedBytes == 0) {
+			return true;
+		}
+
+		int length = file->bufferedBytes;
+		file->bufferedBytes = 0;
+		int bytesWritten = fileWrite(file, &(file->writeBuffer[0]), length);
+		if (bytesWritten > 0) {
+			fileMetadataWrite(file);
+		}
+		return bytesWritten == length;
+	}
 
 	void setDateStruct(SVMDateTimeRef dateStruct, uint16_t dateBytes, uint16_t timeBytes) {
 		//access bits 0-4 for day
@@ -1729,28 +4362,67 @@ extern "C" {
 	}
 
 
-uint16_t findFirstFreeCluster() {
-	//returns cluster number, will need to figure out address in fat.ima if use
-	for (unsigned int i = 0; i < fatTable.size(); i++) {
-		if(fatTable[i] == 0x00) {
-			//std::cout << "First Free Cluster " << i << std::endl;
-			return i;
+// converts filename to the 11 character space padded form directory entries use, false if it can't be one
+bool shortFileName(const char *filename, char *userCopy) {
+	uint32_t userFileLength = VMStringLength(filename);
+	int indexOfDot = -1;
+	//find index of . if it's zero, throw
+
+	if(userFileLength > 12){
+		// not handling long file name
+		return false;
+	}
+
+	// check if proper format/format copy to ShortDirectoryName and 
+	for(int i = 0; i < 8; i++) {
+		if(filename[i] == '.'){
+			if (i == 0) {
+				return false;
+			} else {
+				// if hasnt been set, set index of Dot
+				if (indexOfDot == -1) {
+					indexOfDot = i;
+					userCopy[i] = ' ';
+				} else {
+					return false;
+				}
+				
+			}
+			//pad with spaces or put in character
+		} else {
+			if(indexOfDot > 0){
+				userCopy[i] = ' ';
+			} else {
+				userCopy[i] = filename[i];
+				//toUpper(userCopy[i]);
+			}
+		}
+	}
+
+	if(indexOfDot < 0 && userFileLength > 8) {
+		if(filename[8] == '.') {
+			indexOfDot = 8;
 		}
 	}
-	
-	return -1;
-}
 
-uint16_t findFirstFreeEntry(){
-	//returns entry number, will need to figure out address in fat.ima if use
-	for(int i = 0; i < bpb->RootEntCnt; i++) {
-		if(rootData[i*32] == 0x00) {
-			//std::cout << "First Free Entry " << i << std::endl;
-			return i;
+	// deal with suffix
+	for(int i = 8; i < 11; i++) {
+		if (indexOfDot > 0) {
+			unsigned int sourceIndex = indexOfDot + (i-8) + 1;
+			if (sourceIndex >= userFileLength) {
+				userCopy[i] = ' ';
+			} else {
+				userCopy[i] = filename[sourceIndex];	//get suffix at char after dot indexofDot+(8-8)+1, char + 1 after dot indexofDot+(9-8)+1, char + 2 after dot
+			}
+			//toUpper(userCopy[i]);
+		} else {
+			userCopy[i] = ' ';
 		}
 	}
-	
-	return -1;
+
+	userCopy[11] = '\0'; //null terminate string
+
+	return true;
 }
 
 TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescriptor) {
@@ -1762,78 +4434,14 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 	// see if filename is one of the entries
 	//if yes, go about opening it
 	//else will need to create one (but save for later)
-	uint32_t userFileLength = VMStringLength(filename);
- 
 	char userCopy[20];
-	int indexOfDot = -1;
-	//find index of . if it's zero, throw
 
-	if(userFileLength > 12){
-		// not handling long file name
+	if(!shortFileName(filename, userCopy)){
 		MachineResumeSignals(&sigstate);
 		return VM_STATUS_FAILURE;
 	} else {
-		// check if proper format/format copy to ShortDirectoryName and 
-		for(int i = 0; i < 8; i++) {
-			if(filename[i] == '.'){
-				if (i == 0) {
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_FAILURE;
-				} else {
-					// if hasnt been set, set index of Dot
-					if (indexOfDot == -1) {
-						indexOfDot = i;
-						userCopy[i] = ' ';
-					} else {
-						MachineResumeSignals(&sigstate);
-						return VM_STATUS_FAILURE;
-					}
-					
-				}
-				//pad with spaces or put in character
-			} else {
-				if(indexOfDot > 0){
-					userCopy[i] = ' ';
-				} else {
-					userCopy[i] = filename[i];
-					//toUpper(userCopy[i]);
-				}
-			}
-		}
-
-		if(indexOfDot < 0 && userFileLength > 8) {
-			if(filename[8] == '.') {
-				indexOfDot = 8;
-			}
-		}
-
-		// deal with suffix
-		for(int i = 8; i < 11; i++) {
-			if (indexOfDot > 0) {
-				unsigned int sourceIndex = indexOfDot + (i-8) + 1;
-				if (sourceIndex >= userFileLength) {
-					userCopy[i] = ' ';
-				} else {
-					userCopy[i] = filename[sourceIndex];	//get suffix at char after dot indexofDot+(8-8)+1, char + 1 after dot indexofDot+(9-8)+1, char + 2 after dot
-				}
-				//toUpper(userCopy[i]);
-			} else {
-				userCopy[i] = ' ';
-			}
-		}
-
-		userCopy[11] = '\0'; //null terminate string
-
-		for(unsigned int i = 0; i < rootDirectories.size(); i++) {
-			char dirName[12];
-			VMStringCopyN(dirName, rootDirectories[i]->entry->DShortFileName, 12); // MAY FAIL HERE
-			int result = strcasecmp(userCopy, dirName);
-			if (result == 0) {
-				found = true;
-				foundDirectory = rootDirectories[i];
-				break;
-			}
-		}
+		foundDirectory = directoryLookup(userCopy);
+		found = (foundDirectory != NULL);
 
 		//std::cout << "made it to name comparison" << std::endl;
 
@@ -1866,6 +4474,11 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 				memcpy(openedFile->name, userCopy, 11); //put name here
 
 				openedFile->flags = flags; // set flags
+				openedFile->lastCluster = 0;
+				openedFile->readaheadWindow = 0;
+				openedFile->extentsBuilt = false;
+				openedFile->buffered = false;
+				openedFile->bufferedBytes = 0;
 				SVMDateTime accDate;	// change access Dates
 				VMDateTime(&accDate);
 				openedFile->rootEntry->entry->DAccess = accDate;
@@ -1874,50 +4487,32 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 				uint16_t time = 0;
 				encodeDateStruct(&(openedFile->rootEntry->entry->DAccess), &date, &time);
 
-				//change access date in root section
-
-				uint8_t sectorBuffer[512];
-				uint8_t entryArray[32];
-				int bufferIndex = (32 * openedFile->rootEntry->entryNum);
-
-				ReadSector(fatInformation->FirstRootSector, sectorBuffer);
-
-				memcpy(entryArray, &(sectorBuffer[bufferIndex]), 32);
-				memcpy(&(entryArray[18]), &date, 2);
-				// for future may not want 
-				
-				memcpy(&(sectorBuffer[bufferIndex]), entryArray, 32);
-				WriteSector(fatInformation->FirstRootSector, sectorBuffer);
-
-
-				// write to rootEntry Sector
-				//write the two bytes into the correct place in memory PROBABLY WILL NEED TO CHANGE MIGHT WANT TO JUST MEMCPY WHOLE ENTRY
-				//memcpy(&(rootData[(fatInformation->FirstRootSector * 512) + (entryIndex + 18)]), &(rootData[entryIndex + 18]), 2);
+				//change access date in root section, through rootData so the entry can be in any root sector
+				memcpy(&(rootData[(32 * openedFile->rootEntry->entryNum) + 18]), &date, 2);
+				rootEntryWrite(openedFile->rootEntry->entryNum);
 
 				if((flags & O_APPEND) == O_APPEND) {
 					if(openedFile->rootEntry->entry->DSize > 0) { //if is a file > 0 bytes, will need to find curCluster and new offset within that cluster
-						// set offset to offset in last cluster
-						openedFile->curOffset = (openedFile->rootEntry->entry->DSize % (bpb->SecPerClus * 512));
-						// if the size of the file > the the size of a cluster, find what the current cluster is
-						if (openedFile->rootEntry->entry->DSize > (bpb->SecPerClus * 512)) {
-							int clusSkip = openedFile->rootEntry->entry->DSize / (bpb->SecPerClus * 512);
-							for(int i = 0; i < clusSkip; i++) {
-								int nextCluster = fatTable[openedFile->rootEntry->FstClusLO + i];
-								openedFile->curCluster = nextCluster;
-							}
-						} else {
+						openedFile->curCluster = extentMapLookup(openedFile, openedFile->rootEntry->entry->DSize, &(openedFile->curOffset));
+						openedFile->position = openedFile->rootEntry->entry->DSize;
+						if (openedFile->curCluster < 0) {
+							// chain is shorter than the size says, start at the beginning instead
 							openedFile->curCluster = foundDirectory->FstClusLO;
+							openedFile->curOffset = 0;
+							openedFile->position = 0;
 						}
 					} else {
 						// file size is 0 so just set offset to 0 and cluster to the first one
 						openedFile->curOffset = 0;
 						openedFile->curCluster = foundDirectory->FstClusLO;
+						openedFile->position = 0;
 					}
 
 				} else {
 					// assume starting at the beginning of the file (not appending)
 					openedFile->curCluster = foundDirectory->FstClusLO;
 					openedFile->curOffset = 0;
+					openedFile->position = 0;
 				}
 
 				// memcpy(openedFile->path, VM_FILE_SYSTEM_DIRECTORY_DELIMETER, 1); // get path?
@@ -1946,10 +4541,25 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 			// if can create file, create it
 			// else return Fail
 
+			int freeEntryNum = directorySlotAlloc();
+			if (freeEntryNum < 0) {
+				// root directory is full
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
+			}
+			int allocated;
+			int firstFreeCluster = clusterAlloc(0, 1, &allocated);	// no goal, a new file can go anywhere
+			if (firstFreeCluster < 0) {
+				// volume is full
+				freeDirectorySlots.insert(freeEntryNum);
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
+			}
+
 			struct FileEntry* openedFile = new struct FileEntry;
 			struct DirectoryEntry* newEntry = new struct DirectoryEntry;
-
-			int freeEntryNum = findFirstFreeEntry();
+			newEntry->entry = new SVMDirectoryEntry;
+			newEntry->FstClusLO = firstFreeCluster;
 
 			uint8_t entryArray[32];
 			//std::cout << "File is being created" << std::endl;
@@ -1964,16 +4574,20 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 			openedFile->rootEntry->entryNum = freeEntryNum;
 
 			openedFile->curOffset = 0;
+			openedFile->position = 0;
 
 			memcpy(openedFile->name, userCopy, 12); //put name here WILL WANT TO PUT IN ROOTENTRY->ENTRY AS NAME AS WELL
 			// find next free entry and write to it, setFSClsLO as next free cluster
-			uint16_t firstFreeCluster = findFirstFreeCluster();
-
 			//std::cout << "Cluster was found" << std::endl;
 
 			openedFile->curCluster = firstFreeCluster;
 
 			openedFile->flags = flags; // set flags
+			openedFile->lastCluster = 0;
+			openedFile->readaheadWindow = 0;
+			openedFile->extentsBuilt = true;	// nothing to read from the FAT, the one cluster is added below
+			openedFile->buffered = false;
+			openedFile->bufferedBytes = 0;
 
 			SVMDateTime accDate;	// change access Dates
 			VMDateTime(&accDate);
@@ -2001,7 +4615,8 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 			uint16_t FstClusLO = firstFreeCluster; // need to reserve cluster as well
 			uint32_t FileSize = 0;
 
-			memcpy(&(openedFile->rootEntry->entry->DShortFileName), userCopy, 11);
+			memcpy(&(openedFile->rootEntry->entry->DShortFileName), userCopy, 12);
+			openedFile->rootEntry->entry->DModify = openedFile->rootEntry->entry->DCreate;
 			openedFile->rootEntry->entry->DAttributes = Attr;
 			openedFile->rootEntry->entry->DSize = FileSize;
 
@@ -2018,23 +4633,18 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 			memcpy(&(entryArray[26]), &FstClusLO, 2);
 			memcpy(&(entryArray[28]), &FileSize, 4);
 
-			fatTable[firstFreeCluster] = 0xFFFF;
 			//std::cout << "created Entry Array" << std::endl;
 
-			for(int i = 0; i < bpb->FATSz16; i++) {
-				int secNum = i + 1;
-				WriteSector(secNum, &(fatTable[i * 512]));
-			}
+			fatSet(firstFreeCluster, 0xFFFF);
+			extentMapAppend(openedFile, firstFreeCluster);
 
 			//std::cout << "edited Fat" << std::endl;
 
 			// write to root data sector when done TURN INTO FUNCTION IF POSSIBLE
-			uint8_t sectorBuffer[512];
-			// for future may not want 
-			ReadSector(fatInformation->FirstRootSector, sectorBuffer);
-			int bufferIndex = (32 * freeEntryNum);
-			memcpy(&(sectorBuffer[bufferIndex]), entryArray, 32);
-			WriteSector(fatInformation->FirstRootSector, sectorBuffer);
+			memcpy(&(rootData[32 * freeEntryNum]), entryArray, 32);
+			rootEntryWrite(freeEntryNum);
+			rootDirectories.push_back(newEntry);
+			directoryIndexInsert(newEntry);
 
 			//std::cout << "Write to Image" << std::endl;
 
@@ -2060,6 +4670,60 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 	return VM_STATUS_SUCCESS;
 }
 
+TVMStatus VMFileDelete(const char *filename) {
+	TMachineSignalState sigstate;
+	MachineSuspendSignals(&sigstate);
+
+	if(!filename) {
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_ERROR_INVALID_PARAMETER;
+	}
+
+	char userCopy[20];
+	struct DirectoryEntry* foundDirectory = NULL;
+	if(shortFileName(filename, userCopy)) {
+		foundDirectory = directoryLookup(userCopy);
+	}
+	if(!foundDirectory || (foundDirectory->entry->DAttributes & VM_FILE_SYSTEM_ATTR_DIRECTORY) == VM_FILE_SYSTEM_ATTR_DIRECTORY) {
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_FAILURE;
+	}
+	for(unsigned int i = 3; i < openFiles.size(); i++) {
+		if(openFiles[i] && openFiles[i]->rootEntry == foundDirectory) {
+			// still open
+			MachineResumeSignals(&sigstate);
+			return VM_STATUS_FAILURE;
+		}
+	}
+
+	// give the cluster chain back
+	int cluster = foundDirectory->FstClusLO;
+	while(cluster >= 2 && (unsigned int)cluster < clusterFree.size() && !clusterFree[cluster]) {
+		int nextCluster = fatTable[cluster];
+		fatSet(cluster, 0x0000);
+		clusterRelease(cluster, 1);
+		cluster = nextCluster;
+	}
+
+	// 0xE5 rather than 0x00 since entries after this one are still in use
+	rootData[32 * foundDirectory->entryNum] = 0xE5;
+	rootEntryWrite(foundDirectory->entryNum);
+	freeDirectorySlots.insert(foundDirectory->entryNum);
+
+	directoryIndexRemove(foundDirectory);
+	for(unsigned int i = 0; i < rootDirectories.size(); i++) {
+		if(rootDirectories[i] == foundDirectory) {
+			rootDirectories.erase(rootDirectories.begin() + i);
+			break;
+		}
+	}
+	delete foundDirectory->entry;
+	delete foundDirectory;
+
+	MachineResumeSignals(&sigstate);
+	return VM_STATUS_SUCCESS;
+}
+
 // may not use this function
 int getImageLocation(int clusNum) {
 	int fatLocation = (fatInformation->FirstDataSector + (clusNum - 2) * bpb->SecPerClus) * 512; //May be wrong
@@ -2075,9 +4739,12 @@ TVMStatus VMFileClose(int filedescriptor) {
 	} else {
 		if((unsigned int)filedescriptor < openFiles.size()) {
 			if(openFiles[filedescriptor]) {
+				bool flushed = fileFlush(openFiles[filedescriptor]);
+				readaheadCancel(openFiles[filedescriptor]);
 				openFiles[filedescriptor] = NULL;
+				sectorCacheFlush();
 				MachineResumeSignals(&sigstate);
-				return VM_STATUS_SUCCESS;
+				return flushed ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
 			} else {
 				//file already closed
 				MachineResumeSignals(&sigstate);
@@ -2090,6 +4757,50 @@ TVMStatus VMFileClose(int filedescriptor) {
 	return VM_STATUS_SUCCESS;
 }
 
+// the descriptor's write buffer goes out first. dirty sectors aren't tracked per file and the FAT and root directory
+// are shared, so then every dirty sector is flushed
+TVMStatus VMFileSync(int filedescriptor) {
+	TMachineSignalState sigstate;
+	MachineSuspendSignals(&sigstate);
+
+	if(filedescriptor < 3) {
+		// host files aren't cached
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_SUCCESS;
+	}
+	if((unsigned int)filedescriptor >= openFiles.size() || !openFiles[filedescriptor]) {
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_FAILURE;
+	}
+
+	bool flushed = fileFlush(openFiles[filedescriptor]);
+	sectorCacheFlush();
+	MachineResumeSignals(&sigstate);
+	return flushed ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
+}
+
+TVMStatus VMFileBuffered(int filedescriptor, int enable) {
+	TMachineSignalState sigstate;
+	MachineSuspendSignals(&sigstate);
+
+	if(filedescriptor < 3 || (unsigned int)filedescriptor >= openFiles.size() || !openFiles[filedescriptor]) {
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_FAILURE;
+	}
+
+	struct FileEntry* curFile = openFiles[filedescriptor];
+	if(enable) {
+		curFile->writeBuffer.resize(bpb->SecPerClus * 512);
+	} else if(!fileFlush(curFile)) {
+		MachineResumeSignals(&sigstate);
+		return VM_STATUS_FAILURE;
+	}
+	curFile->buffered = (enable != 0);
+
+	MachineResumeSignals(&sigstate);
+	return VM_STATUS_SUCCESS;
+}
+
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset) {
 	TMachineSignalState sigstate;
 	MachineSuspendSignals(&sigstate);
@@ -2099,38 +4810,36 @@ TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset)
 	} else {
 		if((unsigned int)filedescriptor < openFiles.size()){
 		if(openFiles[filedescriptor]){
-			//if openFiles[filedescriptor]->curLocation + offset (may want start of file info and see if total bytes trying to seek to(start-curLocation-offset) is <= filesize)
-			//if go past bounds of a cluster, change curCluster based on FAT Table
-			if(offset + openFiles[filedescriptor]->curOffset > (bpb->SecPerClus * 512)) {
-				// see if there is next cluster
-				int nextCluster = fatTable[(openFiles[filedescriptor]->curCluster)];
-				if (nextCluster < 0xFFF8) { // if there is next cluster (not an end)
-					openFiles[filedescriptor]->curCluster = nextCluster;
-
-					openFiles[filedescriptor]->curOffset = whence + offset; //add to total and then subtract a cluster worth for offset within cluster
-					openFiles[filedescriptor]->curOffset -= bpb->SecPerClus * 512; // offset within cluster
-				} else {
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_FAILURE;
-				}
-			} else {
-				// set new curLocation and offset (from beginning of clusters)
-				//openFiles[filedescriptor]->curLocation = openFiles[filedescriptor]->curLocation + offset;
-				openFiles[filedescriptor]->curOffset = whence + offset;
+			struct FileEntry* curFile = openFiles[filedescriptor];
+			fileFlush(curFile);	// so the position and size below include buffered writes
+			unsigned int fileSize = curFile->rootEntry->entry->DSize;
+			int base = 0;
+			if(whence == SEEK_CUR) {
+				base = curFile->position;
+			} else if(whence == SEEK_END) {
+				base = fileSize;
+			}
 
+			int target = base + offset;
+			if(target < 0 || (unsigned int)target > fileSize) {
+				// FAT files can't have holes
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
+			}
 
-				if(newoffset){
-				//putnewoffset here
-					std::cout << "offset" << openFiles[filedescriptor]->curOffset << std::endl;
-					*newoffset = openFiles[filedescriptor]->curOffset;
-				} else {
-					MachineResumeSignals(&sigstate);
-					return VM_STATUS_ERROR_INVALID_PARAMETER;	
-				}
-				
+			int clusterOffset;
+			int cluster = extentMapLookup(curFile, target, &clusterOffset);
+			if(cluster < 0) {
+				MachineResumeSignals(&sigstate);
+				return VM_STATUS_FAILURE;
 			}
-			
+			curFile->curCluster = cluster;
+			curFile->curOffset = clusterOffset;
+			curFile->position = target;
 
+			if(newoffset){
+				*newoffset = target;
+			}
 		} else { // file is closed
 			MachineResumeSignals(&sigstate);
 			return VM_STATUS_FAILURE;
@@ -2156,17 +4865,56 @@ TVMStatus VMFileRead(int filedescriptor, void *data, int *length) {
 		if((unsigned int)filedescriptor < openFiles.size()){
 			if(openFiles[filedescriptor]){ // file is open
 				if((openFiles[filedescriptor]->flags & O_ACCMODE) != 1) { // can read
-					char buffer[bpb->SecPerClus * 512];
-					ReadCluster(openFiles[filedescriptor]->curCluster, buffer);
-					//copy memory into data starting at offset within curCluster
-					//only works if length is less than the size of a cluster
-					if(openFiles[filedescriptor]->curOffset + *length < (bpb->SecPerClus * 512)){
-						memcpy(data, &(buffer[(openFiles[filedescriptor]->curOffset)]), *length);
+					struct FileEntry* curFile = openFiles[filedescriptor];
+					fileFlush(curFile);	// so reads see buffered writes
+					unsigned int clusterBytes = bpb->SecPerClus * 512;
+					unsigned int position = curFile->position;
+					unsigned int fileSize = curFile->rootEntry->entry->DSize;
+					int remaining = (position < fileSize) ? fileSize - position : 0;
+					if (*length < remaining) {
+						remaining = *length;
+					}
+					uint8_t *dest = (uint8_t*)data;
+					int bytesRead = 0;
+					char buffer[clusterBytes];
+
+					while(bytesRead < remaining) {
+						if((unsigned int)curFile->curOffset == clusterBytes) {
+							int nextCluster = fatTable[curFile->curCluster];
+							if(nextCluster < 2 || nextCluster >= 0xFFF8) {
+								break;	// chain is shorter than the size says
+							}
+							curFile->curCluster = nextCluster;
+							curFile->curOffset = 0;
+						}
 
-					} else {
-						// read in and then go to next cluster
+						int wanted = remaining - bytesRead;
+						if(curFile->curOffset == 0 && (unsigned int)wanted >= clusterBytes) {
+							// whole clusters go straight into data, as many at once as sit next to each other,
+							// readahead carries on past the end of the run
+							int run = clusterRun(curFile->curCluster, wanted / clusterBytes);
+							bool cached = clusterCached(curFile->curCluster);
+							ReadClusters(curFile->curCluster, &(dest[bytesRead]), run);
+							readaheadUpdate(curFile, curFile->curCluster, run, cached);
+							bytesRead += run * clusterBytes;
+							curFile->curCluster += run - 1;
+							curFile->curOffset = clusterBytes;
+						} else {
+							//copy memory into data starting at offset within curCluster
+							bool cached = clusterCached(curFile->curCluster);
+							ReadCluster(curFile->curCluster, buffer);
+							readaheadUpdate(curFile, curFile->curCluster, 1, cached);
+							int chunk = clusterBytes - curFile->curOffset;
+							if(chunk > wanted) {
+								chunk = wanted;
+							}
+							memcpy(&(dest[bytesRead]), &(buffer[curFile->curOffset]), chunk);
+							bytesRead += chunk;
+							curFile->curOffset += chunk;
+						}
 					}
-					
+					curFile->position += bytesRead;
+					*length = bytesRead;
 				} else {
 					MachineResumeSignals(&sigstate); // file cannot read
 					return VM_STATUS_FAILURE;
@@ -2295,18 +5043,4 @@ TVMStatus VMDirectoryClose(int dirdescriptor) {
 	return VM_STATUS_SUCCESS;
 }
 
-/*	class Cache {
-		unsigned int numSectors, numEntries;
-		uint16_t table[];
-
-		public:
-			Cache(int numSectorsIn){
-				numSectors = numSectorsIn;
-				numEntries = bpb->FATSz16 * 256;
-				table[numEntries];
-			}
-			void setEntries();
-	};
-*/
-
 }